@@ -0,0 +1,551 @@
+#include "TwoDITBTree.h"
+#include "TwoDITwTopK.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+
+
+//
+template <typename Interval, typename Ref>
+static bool lowerEntry(const Ref &a_low, const Interval *a, const Ref &b_low, const Interval *b) {
+
+// the tree's order: low point, then id
+if (Interval::lowerRef(a_low, b_low))
+  return true;
+
+if (Interval::lowerRef(b_low, a_low))
+  return false;
+
+return a->GetId() < b->GetId();
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+const uint32_t TwoDITBTreeNodeT<Interval, KeyTraits>::kFanout;
+
+
+//
+template <typename Interval, typename KeyTraits>
+TwoDITBTreeT<Interval, KeyTraits>::TwoDITBTreeT() : tree_root(nullptr), write_version(1), frozen_version(0) {};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::insert(const Interval* z) {
+
+if (tree_root == nullptr)
+  tree_root = create(true);
+
+typename KeyTraits::Ref z_low = KeyTraits::ref(z->GetLowPoint());
+path.clear();
+Node **link = &tree_root;
+Node *x = writable(link);
+
+while (!x->leaf) {
+  uint32_t i = childIndex(x, z_low, z);
+  path.push_back(std::make_pair(link, i));
+  link = &x->child[i];
+  x = writable(link);
+}
+
+uint32_t i = entryIndex(x, z_low, z);
+entryOpen(x, i);
+entrySet(x, i, z);
+
+Node *extra = (x->count == Node::kFanout) ? split(x) : nullptr;
+
+// refresh the summaries on the way up, giving each parent the new half of a split child
+for (typename std::vector<std::pair<Node**, uint32_t> >::reverse_iterator it = path.rbegin(); it != path.rend(); it++) {
+  Node *p = *it->first;
+  summarize(p, it->second);
+
+  if (extra != nullptr) {
+    entryOpen(p, it->second + 1);
+    p->child[it->second + 1] = extra;
+    summarize(p, it->second + 1);
+    extra = (p->count == Node::kFanout) ? split(p) : nullptr;
+  }
+}
+
+if (extra != nullptr) {
+  Node *r = create(false);
+  r->child[0] = tree_root;
+  r->child[1] = extra;
+  r->count = 2;
+  summarize(r, 0);
+  summarize(r, 1);
+  tree_root = r;
+}
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+bool TwoDITBTreeT<Interval, KeyTraits>::erase(const Interval* z) {
+
+if (tree_root == nullptr)
+  return false;
+
+typename KeyTraits::Ref z_low = KeyTraits::ref(z->GetLowPoint());
+path.clear();
+Node **link = &tree_root;
+Node *x = writable(link);
+
+while (!x->leaf) {
+  uint32_t i = childIndex(x, z_low, z);
+  path.push_back(std::make_pair(link, i));
+  link = &x->child[i];
+  x = writable(link);
+}
+
+uint32_t i = entryIndex(x, z_low, z);
+
+if (i == 0 or x->first[i - 1] != z)
+  return false;
+
+entryClose(x, i - 1);
+
+// refresh the summaries on the way up, topping up any child left less than half full
+for (typename std::vector<std::pair<Node**, uint32_t> >::reverse_iterator it = path.rbegin(); it != path.rend(); it++) {
+  Node *p = *it->first;
+
+  if (p->child[it->second]->count < Node::kFanout / 2)
+    rebalance(p, it->second);
+  else
+    summarize(p, it->second);
+}
+
+// a root left with one child hands the tree down to it
+while (!tree_root->leaf and tree_root->count == 1) {
+  Node *old = tree_root;
+  tree_root = old->child[0];
+  retire(old);
+}
+
+if (tree_root->count == 0) {
+  retire(tree_root);
+  tree_root = nullptr;
+}
+
+return true;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::build(const std::vector<const Interval*> &intervals) {
+
+release(tree_root);
+tree_root = nullptr;
+
+if (intervals.empty())
+  return;
+
+// spread each level evenly over nodes one short of full, bottom-up
+std::vector<Node*> level, next;
+size_t n = intervals.size(), nodes = (n + Node::kFanout - 2) / (Node::kFanout - 1), pos = 0;
+
+for (size_t k = 0; k < nodes; k++) {
+  Node *x = create(true);
+
+  for (size_t end = (k + 1) * n / nodes; pos < end; pos++) {
+    entrySet(x, x->count, intervals[pos]);
+    x->count++;
+  }
+
+  level.push_back(x);
+}
+
+while (level.size() > 1) {
+  n = level.size();
+  nodes = (n + Node::kFanout - 2) / (Node::kFanout - 1);
+  pos = 0;
+
+  for (size_t k = 0; k < nodes; k++) {
+    Node *x = create(false);
+
+    for (size_t end = (k + 1) * n / nodes; pos < end; pos++) {
+      x->child[x->count] = level[pos];
+      summarize(x, x->count);
+      x->count++;
+    }
+
+    next.push_back(x);
+  }
+
+  level.swap(next);
+  next.clear();
+}
+
+tree_root = level[0];
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::clear() {
+
+// only safe once no snapshot is left, the nodes go with their slabs
+tree_root = nullptr;
+path.clear();
+retired.clear();
+frozen_version = 0;
+pool.release();
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::inOrder(const Node* x, std::vector<const Interval*> &intervals) const {
+
+if (x == nullptr)
+  return;
+
+if (x->leaf) {
+  intervals.insert(intervals.end(), x->first, x->first + x->count);
+  return;
+}
+
+for (uint32_t i = 0; i < x->count; i++) {
+  inOrder(x->child[i], intervals);
+}
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+bool TwoDITBTreeT<Interval, KeyTraits>::search(const Node* x, const Interval &test_interval, const Visitor &visit) const {
+
+if (x == nullptr)
+  return true;
+
+return searchRecursive(x, KeyTraits::ref(test_interval.GetLowPoint()), KeyTraits::ref(test_interval.GetHighPoint()), visit);
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+bool TwoDITBTreeT<Interval, KeyTraits>::searchRecursive(const Node* x, const typename KeyTraits::Ref &low, const typename KeyTraits::Ref &high, const Visitor &visit) const {
+
+for (uint32_t i = 0; i < x->count; i++) {
+
+  // entries are in low point order, so the rest start after the query interval
+  if (Interval::lowerRef(high, x->low[i]))
+    break;
+
+  if (Interval::lowerRef(x->high[i], low))
+    continue;
+
+  // false from the visitor stops the whole search
+  if (x->leaf ? !visit(x->first[i]) : !searchRecursive(x->child[i], low, high, visit))
+    return false;
+}
+
+return true;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+int TwoDITBTreeT<Interval, KeyTraits>::height() const {
+
+int h = 0;
+
+for (const Node *x = tree_root; x != nullptr; x = x->leaf ? nullptr : x->child[0]) {
+  h++;
+}
+
+return h;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::print() const {
+
+std::vector<const Node*> level, next;
+
+if (tree_root != nullptr)
+  level.push_back(tree_root);
+
+// one line per level; leaves list (id,low,high,timestamp), internal nodes (first id,max_high,max_timestamp)
+while (!level.empty()) {
+  for (typename std::vector<const Node*>::const_iterator it = level.begin(); it != level.end(); it++) {
+    std::cout<<"[";
+
+    for (uint32_t i = 0; i < (*it)->count; i++) {
+      if ((*it)->leaf)
+        std::cout<<" ("<<(*it)->first[i]->GetId()<<","<<KeyTraits::deref((*it)->low[i])<<","<<KeyTraits::deref((*it)->high[i])
+                 <<","<<(*it)->timestamp[i]<<")";
+      else {
+        std::cout<<" ("<<(*it)->first[i]->GetId()<<","<<KeyTraits::deref((*it)->high[i])<<","<<(*it)->timestamp[i]<<")";
+        next.push_back((*it)->child[i]);
+      }
+    }
+
+    std::cout<<" ] ";
+  }
+
+  std::cout<<std::endl;
+  level.swap(next);
+  next.clear();
+}
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+const typename TwoDITBTreeT<Interval, KeyTraits>::Node* TwoDITBTreeT<Interval, KeyTraits>::freeze(const uint64_t &version) {
+
+// versions follow the store's, so one oldest version covers both
+frozen_version = version;
+write_version = version + 1;
+
+return tree_root;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::reclaim(const uint64_t &oldest) {
+
+// a node dropped in version v is only reachable from snapshots frozen before v
+while (!retired.empty() and retired.front().first <= oldest) {
+  pool.destroy(retired.front().second);
+  retired.pop_front();
+}
+
+if (oldest == UINT64_MAX)
+  frozen_version = 0;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+typename TwoDITBTreeT<Interval, KeyTraits>::Node* TwoDITBTreeT<Interval, KeyTraits>::create(const bool &leaf) {
+
+Node *x = pool.create();
+x->version = write_version;
+x->count = 0;
+x->leaf = leaf;
+
+return x;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+typename TwoDITBTreeT<Interval, KeyTraits>::Node* TwoDITBTreeT<Interval, KeyTraits>::writable(Node** link) {
+
+Node *x = *link;
+
+if (x->version > frozen_version)
+  return x;
+
+// the snapshot keeps the original, the writer continues on a copy
+Node *copy = pool.create(*x);
+copy->version = write_version;
+retired.push_back(std::make_pair(write_version, x));
+*link = copy;
+
+return copy;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::retire(Node* x) {
+
+if (x->version > frozen_version)
+  pool.destroy(x);
+else
+  retired.push_back(std::make_pair(write_version, x));
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::release(Node* x) {
+
+if (x == nullptr)
+  return;
+
+if (!x->leaf) {
+  for (uint32_t i = 0; i < x->count; i++) {
+    release(x->child[i]);
+  }
+}
+
+retire(x);
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+uint32_t TwoDITBTreeT<Interval, KeyTraits>::childIndex(const Node* x, const typename KeyTraits::Ref &z_low, const Interval* z) const {
+
+// the last child starting at or before z, or the first one if z precedes them all
+uint32_t i = entryIndex(x, z_low, z);
+
+return (i > 0) ? i - 1 : 0;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+uint32_t TwoDITBTreeT<Interval, KeyTraits>::entryIndex(const Node* x, const typename KeyTraits::Ref &z_low, const Interval* z) const {
+
+// the first entry after z; a linear scan over one node's prefixes beats a binary search
+uint32_t i = 0;
+
+while (i < x->count and !lowerEntry(z_low, z, x->low[i], x->first[i]))
+  i++;
+
+return i;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::summarize(Node* x, const uint32_t &i) {
+
+const Node *c = x->child[i];
+
+x->low[i] = c->low[0];
+x->first[i] = c->first[0];
+x->high[i] = c->high[0];
+x->timestamp[i] = c->timestamp[0];
+x->min_timestamp[i] = c->min_timestamp[0];
+
+for (uint32_t j = 1; j < c->count; j++) {
+  if (Interval::lowerRef(x->high[i], c->high[j]))
+    x->high[i] = c->high[j];
+
+  if (x->timestamp[i] < c->timestamp[j])
+    x->timestamp[i] = c->timestamp[j];
+
+  if (x->min_timestamp[i] > c->min_timestamp[j])
+    x->min_timestamp[i] = c->min_timestamp[j];
+}
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::entrySet(Node* x, const uint32_t &i, const Interval* z) {
+
+x->low[i] = KeyTraits::ref(z->GetLowPoint());
+x->high[i] = KeyTraits::ref(z->GetHighPoint());
+x->timestamp[i] = z->GetTimeStamp();
+x->min_timestamp[i] = x->timestamp[i];
+x->first[i] = z;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::entryOpen(Node* x, const uint32_t &i) {
+
+entryMove(x, i + 1, x, i, x->count - i);
+x->count++;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::entryClose(Node* x, const uint32_t &i) {
+
+entryMove(x, i, x, i + 1, x->count - i - 1);
+x->count--;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::entryMove(Node* to, const uint32_t &to_i, Node* from, const uint32_t &from_i, const uint32_t &n) {
+
+// entries are plain data, and memmove also covers shifts within one node
+memmove(to->low + to_i, from->low + from_i, n * sizeof(to->low[0]));
+memmove(to->high + to_i, from->high + from_i, n * sizeof(to->high[0]));
+memmove(to->timestamp + to_i, from->timestamp + from_i, n * sizeof(to->timestamp[0]));
+memmove(to->min_timestamp + to_i, from->min_timestamp + from_i, n * sizeof(to->min_timestamp[0]));
+memmove(to->first + to_i, from->first + from_i, n * sizeof(to->first[0]));
+
+if (!to->leaf)
+  memmove(to->child + to_i, from->child + from_i, n * sizeof(to->child[0]));
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+typename TwoDITBTreeT<Interval, KeyTraits>::Node* TwoDITBTreeT<Interval, KeyTraits>::split(Node* x) {
+
+Node *right = create(x->leaf);
+uint32_t half = x->count / 2;
+
+entryMove(right, 0, x, half, x->count - half);
+right->count = x->count - half;
+x->count = half;
+
+return right;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+void TwoDITBTreeT<Interval, KeyTraits>::rebalance(Node* p, const uint32_t &i) {
+
+if (p->child[i]->count == 0) {
+  retire(p->child[i]);
+  entryClose(p, i);
+  return;
+}
+
+if (p->count < 2) {
+  summarize(p, i);
+  return;
+}
+
+// pair the child with a neighbour, merging them if both fit in one node
+uint32_t l = (i > 0) ? i - 1 : i, r = l + 1;
+Node *left = writable(&p->child[l]), *right = writable(&p->child[r]);
+
+if (left->count + right->count < Node::kFanout) {
+  entryMove(left, left->count, right, 0, right->count);
+  left->count += right->count;
+  retire(right);
+  entryClose(p, r);
+  summarize(p, l);
+  return;
+}
+
+// otherwise share the entries out evenly
+uint32_t want = (left->count + right->count) / 2;
+
+if (left->count < want) {
+  uint32_t n = want - left->count;
+  entryMove(left, left->count, right, 0, n);
+  left->count += n;
+  entryMove(right, 0, right, n, right->count - n);
+  right->count -= n;
+}
+else {
+  uint32_t n = left->count - want;
+  entryMove(right, n, right, 0, right->count);
+  entryMove(right, 0, left, want, n);
+  right->count += n;
+  left->count = want;
+}
+
+summarize(p, l);
+summarize(p, r);
+};
+
+
+// the key types built into the library
+template class TwoDITBTreeT<TwoDIntervalT<std::string>, TwoDITKeyTraits<std::string> >;
+template class TwoDITBTreeT<TwoDIntervalT<uint64_t>, TwoDITKeyTraits<uint64_t> >;
+template class TwoDITBTreeT<TwoDIntervalT<int64_t>, TwoDITKeyTraits<int64_t> >;
+template class TwoDITBTreeT<TwoDIntervalT<double>, TwoDITKeyTraits<double> >;
@@ -0,0 +1,91 @@
+#ifndef TWOD_IT_BTREE_H
+#define TWOD_IT_BTREE_H
+
+#include "TwoDITPool.h"
+#include <deque>
+#include <functional>
+#include <inttypes.h>
+#include <utility>
+#include <vector>
+
+
+
+// Node of the B+-tree engine. Entries are parallel arrays, so a scan over one field reads
+// consecutive memory. In a leaf, entry i is an interval; in an internal node it sums up
+// child i: its first interval in (low, id) order, its largest high point and its newest
+// and oldest timestamps.
+template <typename Interval, typename KeyTraits>
+struct TwoDITBTreeNodeT {
+  static const uint32_t kFanout = 16;
+
+  uint64_t version; // write version the node was created in
+  uint32_t count;
+  bool leaf;
+  typename KeyTraits::Ref low[kFanout], high[kFanout];
+  uint64_t timestamp[kFanout], min_timestamp[kFanout];
+  const Interval *first[kFanout];
+  TwoDITBTreeNodeT *child[kFanout];
+};
+
+
+// Augmented B+-tree over interval pointers, ordered by (low, id). Wide nodes keep the
+// per-child max_high/max_timestamp summaries together, so a descent costs a few cache
+// misses per level of 16 children instead of one per binary level. Nodes shared with a
+// published snapshot are copied before writing, like the red-black tree's.
+template <typename Interval, typename KeyTraits>
+class TwoDITBTreeT {
+public:
+  typedef TwoDITBTreeNodeT<Interval, KeyTraits> Node;
+  typedef std::function<bool(const Interval*)> Visitor;
+
+  TwoDITBTreeT();
+
+  void insert(const Interval* z);
+  bool erase(const Interval* z);
+  void build(const std::vector<const Interval*> &intervals);
+  void clear();
+
+  const Node* root() const {return tree_root;};
+  void inOrder(const Node* x, std::vector<const Interval*> &intervals) const;
+  bool search(const Node* x, const Interval &test_interval, const Visitor &visit) const;
+  int height() const;
+  void print() const;
+
+  // the returned root stays readable, whatever writers do meanwhile, until reclaim() is
+  // given an oldest snapshot version past the one frozen here
+  const Node* freeze(const uint64_t &version);
+  void reclaim(const uint64_t &oldest);
+
+private:
+
+  Node* create(const bool &leaf);
+  Node* writable(Node** link);
+  void retire(Node* x);
+  void release(Node* x);
+  uint32_t childIndex(const Node* x, const typename KeyTraits::Ref &z_low, const Interval* z) const;
+  uint32_t entryIndex(const Node* x, const typename KeyTraits::Ref &z_low, const Interval* z) const;
+  void summarize(Node* x, const uint32_t &i);
+  void entrySet(Node* x, const uint32_t &i, const Interval* z);
+  void entryOpen(Node* x, const uint32_t &i);
+  void entryClose(Node* x, const uint32_t &i);
+  void entryMove(Node* to, const uint32_t &to_i, Node* from, const uint32_t &from_i, const uint32_t &n);
+  Node* split(Node* x);
+  void rebalance(Node* p, const uint32_t &i);
+  bool searchRecursive(const Node* x, const typename KeyTraits::Ref &low, const typename KeyTraits::Ref &high, const Visitor &visit) const;
+
+  TwoDITBTreeT(const TwoDITBTreeT&);
+  TwoDITBTreeT& operator=(const TwoDITBTreeT&);
+
+  Node *tree_root;
+
+  // links to the nodes from the root down to the leaf, with the child taken in each
+  std::vector<std::pair<Node**, uint32_t> > path;
+
+  // retired nodes with the write version that dropped them, oldest first
+  uint64_t write_version, frozen_version;
+  std::deque<std::pair<uint64_t, Node*> > retired;
+  TwoDITPool<Node> pool;
+};
+
+
+#endif
@@ -0,0 +1,520 @@
+#include "TwoDITFileIndex.h"
+#include <algorithm>
+#include <iostream>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+
+
+
+//
+template <typename Key, typename Compare>
+TwoDITFileIndexT<Key, Compare>::TwoDITFileIndexT(const TwoDITEngine &engine) : block_count(0), generation(0), reclaimed(0), files(engine) {
+
+// the blocks are not synced, so neither are the file intervals
+files.setSyncFile("");
+};
+
+
+//
+template <typename Key, typename Compare>
+TwoDITFileIndexT<Key, Compare>::~TwoDITFileIndexT() {
+
+// the arrays still in use; the file store frees the retired ones as it goes
+std::vector<const FileBlocks*> arrays;
+file_blocks.values(arrays);
+
+for (typename std::vector<const FileBlocks*>::iterator it = arrays.begin(); it != arrays.end(); it++) {
+  delete *it;
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::insertInterval(const TwoDITId &id, const Key &minKey, const Key &maxKey, const uint64_t &maxTimestamp) {
+
+std::lock_guard<std::mutex> lock(write_mutex);
+Block block = {id.block, minKey, maxKey, maxTimestamp};
+
+if (id.hasBlock() and appendBlock(id.file, block))
+  return;
+
+// a file grown one block at a time is rebuilt with room to grow as much again
+std::vector<TwoDInterval> intervals(1, TwoDInterval(id, minKey, maxKey, maxTimestamp));
+insertBlocks(intervals, true);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::bulkInsert(const std::vector<TwoDInterval> &intervals) {
+
+std::lock_guard<std::mutex> lock(write_mutex);
+insertBlocks(intervals, false);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::insertBlocks(const std::vector<TwoDInterval> &intervals, const bool &room) {
+
+std::vector<std::pair<uint64_t, std::vector<Block> > > changed;
+std::unordered_map<uint64_t, size_t> position;
+
+for (typename std::vector<TwoDInterval>::const_iterator it = intervals.begin(); it != intervals.end(); it++) {
+  const TwoDITId &id = it->GetId();
+
+  if (!id.hasBlock()) {
+    std::cerr<<std::endl<<"Insert failure: "<<id<<" names no block"<<std::endl;
+    continue;
+  }
+
+  // a file's new blocks join its old ones; buildFile keeps the last given for a number
+  if (position.find(id.file) == position.end()) {
+    position[id.file] = changed.size();
+    changed.push_back(std::make_pair(id.file, std::vector<Block>()));
+    const FileBlocks *old = file_blocks.find(id.file);
+
+    if (old != nullptr)
+      changed.back().second.assign(old->blocks.begin(), old->blocks.begin() + old->count);
+  }
+
+  Block block = {id.block, it->GetLowPoint(), it->GetHighPoint(), it->GetTimeStamp()};
+  changed[position[id.file]].second.push_back(block);
+}
+
+writeFiles(changed, room);
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TwoDITFileIndexT<Key, Compare>::appendBlock(const uint64_t &number, const Block &block) {
+
+// the index allocated the arrays itself, only the table hands them out as const
+FileBlocks *file = const_cast<FileBlocks*>(file_blocks.find(number));
+
+if (file == nullptr)
+  return false;
+
+uint32_t count = file->count;
+const Block &last = file->blocks[count - 1];
+
+// the block must sort last both ways, and keep the high points ascending if they were
+if (count == file->blocks.size() or TwoDInterval::lower(block.low, last.low) or block.block <= file->blocks[file->by_number[count - 1]].block)
+  return false;
+
+if (file->ordered and TwoDInterval::lower(block.high, last.high))
+  return false;
+
+file->blocks[count] = block;
+file->by_number[count] = count;
+file->count = count + 1;
+block_count++;
+
+if (!TwoDInterval::lower(file->high, block.high) and file->timestamp >= block.timestamp)
+  return true;
+
+if (TwoDInterval::lower(file->high, block.high))
+  file->high = block.high;
+
+file->timestamp = std::max(file->timestamp, block.timestamp);
+files.insertInterval(TwoDITId(number), file->low, file->high, file->timestamp);
+return true;
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::deleteInterval(const TwoDITId &id) {
+
+std::lock_guard<std::mutex> lock(write_mutex);
+
+const FileBlocks *old = file_blocks.find(id.file);
+
+if (old == nullptr or !id.hasBlock() or findBlock(*old, id.block) == nullptr)
+  return;
+
+std::vector<std::pair<uint64_t, std::vector<Block> > > changed(1, std::make_pair(id.file, std::vector<Block>()));
+
+for (typename std::vector<Block>::const_iterator it = old->blocks.begin(); it != old->blocks.begin() + old->count; it++) {
+  if (it->block != id.block)
+    changed[0].second.push_back(*it);
+}
+
+writeFiles(changed, false);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::deleteAllIntervals(const uint64_t &file) {
+
+std::lock_guard<std::mutex> lock(write_mutex);
+
+if (file_blocks.find(file) == nullptr)
+  return;
+
+// one delete in the file store, however many blocks the file had
+std::vector<std::pair<uint64_t, std::vector<Block> > > changed(1, std::make_pair(file, std::vector<Block>()));
+writeFiles(changed, false);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::writeFiles(const std::vector<std::pair<uint64_t, std::vector<Block> > > &changed, const bool &room) {
+
+// tables the block table drops from here on are tagged generation + 1, and freed once a
+// release retired after this write has run
+file_blocks.reclaim(reclaimed);
+file_blocks.freeze(generation);
+
+typename Store::WriteBatch batch;
+std::vector<const FileBlocks*> dropped;
+
+for (typename std::vector<std::pair<uint64_t, std::vector<Block> > >::const_iterator it = changed.begin(); it != changed.end(); it++) {
+  const FileBlocks *old = file_blocks.find(it->first);
+
+  if (old != nullptr) {
+    block_count -= old->count;
+    dropped.push_back(old);
+  }
+
+  if (it->second.empty()) {
+    if (old != nullptr) {
+      file_blocks.erase(it->first);
+      batch.deleteInterval(TwoDITId(it->first));
+    }
+    continue;
+  }
+
+  std::vector<Block> blocks(it->second);
+  FileBlocks *file = buildFile(blocks, room);
+  block_count += file->count;
+  file_blocks.set(it->first, file);
+  batch.insertInterval(TwoDITId(it->first), file->low, file->high, file->timestamp);
+}
+
+if (batch.size() == 0)
+  return;
+
+files.applyBatch(batch);
+
+// queries that may still read the old arrays or tables hold off the release
+uint64_t done = ++generation;
+std::atomic<uint64_t> *reclaimed = &this->reclaimed;
+
+files.retire([dropped, done, reclaimed]() {
+  for (typename std::vector<const FileBlocks*>::const_iterator it = dropped.begin(); it != dropped.end(); it++) {
+    delete *it;
+  }
+
+  *reclaimed = done;
+});
+};
+
+
+//
+template <typename Key, typename Compare>
+typename TwoDITFileIndexT<Key, Compare>::FileBlocks* TwoDITFileIndexT<Key, Compare>::buildFile(std::vector<Block> &blocks, const bool &room) {
+
+// the last block given for a number replaces the others
+std::stable_sort(blocks.begin(), blocks.end(), [](const Block &a, const Block &b) {return a.block < b.block;});
+size_t kept = 0;
+
+for (size_t i = 0; i < blocks.size(); i++) {
+  if (i + 1 < blocks.size() and blocks[i + 1].block == blocks[i].block)
+    continue;
+
+  blocks[kept++] = blocks[i];
+}
+
+blocks.resize(kept);
+std::sort(blocks.begin(), blocks.end(), [](const Block &a, const Block &b) {return TwoDInterval::lower(a.low, b.low);});
+
+FileBlocks *file = new FileBlocks();
+file->blocks.swap(blocks);
+file->ordered = true;
+file->low = file->blocks.front().low;
+file->high = file->blocks.front().high;
+file->timestamp = 0;
+
+for (size_t i = 0; i < file->blocks.size(); i++) {
+  const Block &block = file->blocks[i];
+
+  if (i > 0 and TwoDInterval::lower(block.high, file->blocks[i - 1].high))
+    file->ordered = false;
+
+  if (TwoDInterval::lower(file->high, block.high))
+    file->high = block.high;
+
+  file->timestamp = std::max(file->timestamp, block.timestamp);
+  file->by_number.push_back(i);
+}
+
+const std::vector<Block> &sorted = file->blocks;
+std::sort(file->by_number.begin(), file->by_number.end(), [&sorted](const uint32_t &a, const uint32_t &b) {return sorted[a].block < sorted[b].block;});
+
+file->count = kept;
+
+if (room) {
+  file->blocks.resize(2 * kept);
+  file->by_number.resize(2 * kept);
+}
+
+return file;
+};
+
+
+//
+template <typename Key, typename Compare>
+const typename TwoDITFileIndexT<Key, Compare>::Block* TwoDITFileIndexT<Key, Compare>::findBlock(const FileBlocks &file, const uint64_t &block) {
+
+std::vector<uint32_t>::const_iterator end = file.by_number.begin() + file.count;
+std::vector<uint32_t>::const_iterator it = std::lower_bound(file.by_number.begin(), end, block, [&file](const uint32_t &x, const uint64_t &b) {
+  return file.blocks[x].block < b;
+});
+
+if (it == end or file.blocks[*it].block != block)
+  return nullptr;
+
+return &file.blocks[*it];
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::fileOverlaps(const FileBlocks &file, const Key &minKey, const Key &maxKey, const std::function<void(const Block&)> &visit) {
+
+// blocks past maxKey start too late; with ascending high points those before the first
+// reaching minKey end too early
+typename std::vector<Block>::const_iterator begin = file.blocks.begin();
+typename std::vector<Block>::const_iterator end = std::upper_bound(file.blocks.begin(), file.blocks.begin() + file.count, maxKey, [](const Key &k, const Block &b) {
+  return TwoDInterval::lower(k, b.low);
+});
+
+if (file.ordered) {
+  begin = std::lower_bound(file.blocks.begin(), end, minKey, [](const Block &b, const Key &k) {
+    return TwoDInterval::lower(b.high, k);
+  });
+}
+
+for (typename std::vector<Block>::const_iterator it = begin; it != end; it++) {
+  if (!TwoDInterval::lower(it->high, minKey))
+    visit(*it);
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::getInterval(TwoDInterval &ret_interval, const TwoDITId &id) const {
+
+typename Store::ReadGuard guard(files);
+const FileBlocks *file = file_blocks.find(id.file);
+const Block *block = (file != nullptr and id.hasBlock()) ? findBlock(*file, id.block) : nullptr;
+
+if (block != nullptr)
+  ret_interval = TwoDInterval(id, block->low, block->high, block->timestamp);
+else
+  ret_interval = TwoDInterval();
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey) const {
+
+visitOverlaps(minKey, maxKey, [&ret_value](const TwoDInterval &interval) {
+  ret_value.push_back(interval);
+  return true;
+});
+
+std::stable_sort(ret_value.begin(), ret_value.end(), std::greater<TwoDInterval>());
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k) const {
+
+topK(ret_value, minKey, maxKey, k, 0, UINT64_MAX);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
+
+if (k == 0)
+  return;
+
+typename Store::ReadGuard guard(files);
+std::vector<std::pair<uint64_t, uint64_t> > overlapping;
+
+// files with nothing as new as the window are left out whole
+files.visitOverlaps(minKey, maxKey, [&overlapping, &minTimestamp](const TwoDInterval &file) {
+  if (file.GetTimeStamp() >= minTimestamp)
+    overlapping.push_back(std::make_pair(file.GetTimeStamp(), file.GetId().file));
+  return true;
+});
+
+std::sort(overlapping.begin(), overlapping.end(), std::greater<std::pair<uint64_t, uint64_t> >());
+
+// the k newest blocks so far, oldest on top: timestamp, then file and block
+typedef std::pair<uint64_t, std::pair<uint64_t, const Block*> > Found;
+struct Newer {
+  bool operator()(const Found &a, const Found &b) const {return a.first > b.first;};
+};
+std::priority_queue<Found, std::vector<Found>, Newer> heap;
+
+for (std::vector<std::pair<uint64_t, uint64_t> >::iterator it = overlapping.begin(); it != overlapping.end(); it++) {
+  // newest first, so once a file has nothing newer than the k-th best, neither has any after it
+  if (heap.size() == k and it->first <= heap.top().first)
+    break;
+
+  const FileBlocks *file = file_blocks.find(it->second);
+
+  if (file == nullptr)
+    continue;
+
+  uint64_t number = it->second;
+
+  fileOverlaps(*file, minKey, maxKey, [&](const Block &block) {
+    if (block.timestamp < minTimestamp or block.timestamp > maxTimestamp)
+      return;
+
+    if (heap.size() < k)
+      heap.push(Found(block.timestamp, std::make_pair(number, &block)));
+    else if (block.timestamp > heap.top().first) {
+      heap.pop();
+      heap.push(Found(block.timestamp, std::make_pair(number, &block)));
+    }
+  });
+}
+
+size_t first = ret_value.size();
+
+while (!heap.empty()) {
+  const Block *block = heap.top().second.second;
+  ret_value.push_back(TwoDInterval(TwoDITId(heap.top().second.first, block->block), block->low, block->high, block->timestamp));
+  heap.pop();
+}
+
+std::reverse(ret_value.begin() + first, ret_value.end());
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::visitOverlaps(const Key &minKey, const Key &maxKey, const Visitor &visit) const {
+
+std::vector<TwoDInterval> overlaps;
+
+{
+  typename Store::ReadGuard guard(files);
+
+  files.visitOverlaps(minKey, maxKey, [&](const TwoDInterval &summary) {
+    const FileBlocks *file = file_blocks.find(summary.GetId().file);
+
+    if (file != nullptr) {
+      uint64_t number = summary.GetId().file;
+
+      fileOverlaps(*file, minKey, maxKey, [&overlaps, &number](const Block &block) {
+        overlaps.push_back(TwoDInterval(TwoDITId(number, block.block), block.low, block.high, block.timestamp));
+      });
+    }
+    return true;
+  });
+}
+
+// each file's blocks come in low point order, the files' own ranges interleave
+std::stable_sort(overlaps.begin(), overlaps.end(), [](const TwoDInterval &a, const TwoDInterval &b) {
+  return TwoDInterval::lower(a.GetLowPoint(), b.GetLowPoint());
+});
+
+for (typename std::vector<TwoDInterval>::iterator it = overlaps.begin(); it != overlaps.end(); it++) {
+  if (!visit(*it))
+    break;
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey) const {
+
+std::vector<TwoDITFileHits> hits;
+
+{
+  typename Store::ReadGuard guard(files);
+
+  // a file's blocks are together already, so only block numbers are taken, not intervals
+  files.visitOverlaps(minKey, maxKey, [&](const TwoDInterval &summary) {
+    const FileBlocks *file = file_blocks.find(summary.GetId().file);
+
+    if (file == nullptr)
+      return true;
+
+    TwoDITFileHits found = {summary.GetId().file, 0, std::vector<uint64_t>()};
+
+    fileOverlaps(*file, minKey, maxKey, [&found](const Block &block) {
+      found.blocks.push_back(block.block);
+      found.timestamp = std::max(found.timestamp, block.timestamp);
+    });
+
+    if (!found.blocks.empty())
+      hits.push_back(found);
+    return true;
+  });
+}
+
+for (std::vector<TwoDITFileHits>::iterator it = hits.begin(); it != hits.end(); it++) {
+  std::sort(it->blocks.begin(), it->blocks.end());
+}
+
+std::sort(hits.begin(), hits.end(), [](const TwoDITFileHits &a, const TwoDITFileHits &b) {
+  return a.timestamp > b.timestamp or (a.timestamp == b.timestamp and a.file < b.file);
+});
+
+ret_value.insert(ret_value.end(), hits.begin(), hits.end());
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k) const {
+
+topKByFile(ret_value, minKey, maxKey, k, 0, UINT64_MAX);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
+
+Store::groupByFile(ret_value, [&](const Visitor &add) {
+  std::vector<TwoDInterval> newest;
+  topK(newest, minKey, maxKey, k, minTimestamp, maxTimestamp);
+
+  for (typename std::vector<TwoDInterval>::iterator it = newest.begin(); it != newest.end(); it++) {
+    add(*it);
+  }
+});
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::getSize(uint64_t &size) const { size = block_count; };
+template <typename Key, typename Compare>
+void TwoDITFileIndexT<Key, Compare>::getFileCount(uint64_t &count) const { files.getSize(count); };
+
+
+
+template class TwoDITFileIndexT<std::string>;
+template class TwoDITFileIndexT<uint64_t>;
+template class TwoDITFileIndexT<int64_t>;
+template class TwoDITFileIndexT<double>;
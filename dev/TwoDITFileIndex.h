@@ -0,0 +1,95 @@
+#ifndef TWOD_IT_FILE_INDEX_H
+#define TWOD_IT_FILE_INDEX_H
+
+#include "TwoDITwTopK.h"
+#include <atomic>
+#include <functional>
+#include <inttypes.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+
+// Block intervals indexed in two levels. A store holds one interval per file, the union of
+// its blocks' ranges with their newest timestamp, and each file keeps its blocks in an array
+// sorted by low point, read only when the file's interval overlaps a query. A file is
+// written as a whole: the new array replaces the old one, which is freed once no query can
+// still be reading it, so queries take no lock and deleting a file is one tree delete. A
+// block past all of a file's others, as a table file writes them, is appended in place. Ids
+// must carry a block number. Nothing is synced, so the index is rebuilt, not reloaded.
+template <typename Key, typename Compare = std::less<Key> >
+class TwoDITFileIndexT {
+public:
+  typedef TwoDIntervalT<Key, Compare> TwoDInterval;
+  typedef TwoDITwTopKT<Key, Compare> Store;
+  typedef typename Store::Visitor Visitor;
+
+  explicit TwoDITFileIndexT(const TwoDITEngine &engine = ENGINE_RBTREE);
+  ~TwoDITFileIndexT();
+
+  // a block that sorts last in its file, by low point and number, is appended in place; other
+  // writes copy the blocks of the files they touch
+  void insertInterval(const TwoDITId &id, const Key &minKey, const Key &maxKey, const uint64_t &maxTimestamp);
+  void bulkInsert(const std::vector<TwoDInterval> &intervals);
+
+  void deleteInterval(const TwoDITId &id);
+  void deleteAllIntervals(const uint64_t &file);
+
+  // a query running alongside writes sees each file as it was at some point during the query
+  void getInterval(TwoDInterval &ret_interval, const TwoDITId &id) const;
+  void topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey) const;
+  void topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k) const;
+  void topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+  void visitOverlaps(const Key &minKey, const Key &maxKey, const Visitor &visit) const;
+
+  // the same results grouped by file, files newest first
+  void topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey) const;
+  void topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k) const;
+  void topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+
+  // blocks, and files, stored
+  void getSize(uint64_t &size) const;
+  void getFileCount(uint64_t &count) const;
+
+private:
+
+  struct Block {
+    uint64_t block;
+    Key low, high;
+    uint64_t timestamp;
+  };
+
+  // the arrays may have room past count: an appended block is written there and then counted,
+  // so queries never see it half written
+  struct FileBlocks {
+    std::vector<Block> blocks;        // by low point
+    std::vector<uint32_t> by_number;  // positions in blocks, by block number
+    std::atomic<uint32_t> count;      // blocks in use
+    bool ordered;                     // high points ascend with the low points, as in a table file
+    Key low, high;
+    uint64_t timestamp;
+  };
+
+  void insertBlocks(const std::vector<TwoDInterval> &intervals, const bool &room);
+  bool appendBlock(const uint64_t &number, const Block &block);
+  void writeFiles(const std::vector<std::pair<uint64_t, std::vector<Block> > > &files, const bool &room);
+  static FileBlocks* buildFile(std::vector<Block> &blocks, const bool &room);
+  static const Block* findBlock(const FileBlocks &file, const uint64_t &block);
+  static void fileOverlaps(const FileBlocks &file, const Key &minKey, const Key &maxKey, const std::function<void(const Block&)> &visit);
+
+  TwoDITFileIndexT(const TwoDITFileIndexT&);
+  TwoDITFileIndexT& operator=(const TwoDITFileIndexT&);
+
+  std::mutex write_mutex;
+  std::atomic<uint64_t> block_count;
+  uint64_t generation;                // writes so far, the versions the block table is frozen at
+  std::atomic<uint64_t> reclaimed;    // generations no query can still be reading
+  TwoDITHashMap<uint64_t, FileBlocks, std::hash<uint64_t> > file_blocks;
+  Store files;                        // last, as its retired releases free what the members above hold
+};
+
+typedef TwoDITFileIndexT<std::string> TwoDITFileIndex;
+
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef TWOD_IT_HASH_MAP_H
+#define TWOD_IT_HASH_MAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <inttypes.h>
+#include <utility>
+#include <vector>
+
+
+
+// Open addressing hash map from a trivially copyable key to a pointer, written by one thread
+// and read by any number of others without locks. A slot's key is set once, before its
+// value is first published, and a deleted key leaves a tombstone until the table is
+// rebuilt. A rebuilt table is retired, with the write version that dropped it, until
+// reclaim() is given an oldest reader version past it, like the trees' nodes.
+template <typename Key, typename Value, typename Hash>
+class TwoDITHashMap {
+public:
+  TwoDITHashMap() : table(nullptr), count(0), used(0), write_version(1) {};
+  ~TwoDITHashMap() {clear();};
+
+  // safe alongside the writer, as long as the caller holds off reclaim()
+  const Value* find(const Key &key) const {
+    const Table *t = table.load();
+    if (t == nullptr)
+      return nullptr;
+    for (size_t i = t->slot(key); ; i = (i + 1) & t->mask) {
+      const Value *value = t->slots[i].value.load();
+      if (value == nullptr)
+        return nullptr;
+      if (t->slots[i].key == key)
+        return (value == tombstone()) ? nullptr : value;
+    }
+  };
+
+  // the writer's side
+  void set(const Key &key, const Value* value) {
+    if ((used + 1) * 4 > capacity() * 3)
+      rebuild(count + 1);
+    Table *t = table.load(std::memory_order_relaxed);
+    Slot &s = t->slots[probe(t, key)];
+    const Value *old = s.value.load(std::memory_order_relaxed);
+    if (old == nullptr) {
+      s.key = key;
+      used++;
+    }
+    if (old == nullptr or old == tombstone())
+      count++;
+    s.value.store(value);
+  };
+
+  const Value* erase(const Key &key) {
+    Table *t = table.load(std::memory_order_relaxed);
+    if (t == nullptr)
+      return nullptr;
+    Slot &s = t->slots[probe(t, key)];
+    const Value *old = s.value.load(std::memory_order_relaxed);
+    if (old == nullptr or old == tombstone())
+      return nullptr;
+    s.value.store(tombstone());
+    count--;
+    return old;
+  };
+
+  void reserve(const size_t &n) {
+    if (n * 4 > capacity() * 3)
+      rebuild(n);
+  };
+
+  // only safe once no reader is left
+  void clear() {
+    delete table.load(std::memory_order_relaxed);
+    table.store(nullptr);
+    count = 0;
+    used = 0;
+    reclaim(UINT64_MAX);
+  };
+
+  void values(std::vector<const Value*> &ret) const {
+    const Table *t = table.load(std::memory_order_relaxed);
+    for (size_t i = 0; t != nullptr and i <= t->mask; i++) {
+      const Value *value = t->slots[i].value.load(std::memory_order_relaxed);
+      if (value != nullptr and value != tombstone())
+        ret.push_back(value);
+    }
+  };
+
+  size_t size() const {return count;};
+
+  // tables dropped from here on wait for readers past version
+  void freeze(const uint64_t &version) {write_version = version + 1;};
+
+  void reclaim(const uint64_t &oldest) {
+    while (!retired.empty() and retired.front().first <= oldest) {
+      delete retired.front().second;
+      retired.pop_front();
+    }
+  };
+
+private:
+
+  struct Slot {
+    Slot() : key(), value(nullptr) {};
+    Key key;
+    std::atomic<const Value*> value; // nullptr while the slot is unused
+  };
+
+  struct Table {
+    explicit Table(const size_t &capacity) : mask(capacity - 1), shift(64), slots(new Slot[capacity]) {
+      for (size_t c = capacity; c > 1; c >>= 1)
+        shift--;
+    };
+    ~Table() {delete [] slots;};
+    // the top bits of a multiplicative hash, so hashes differing only in high bits still spread
+    size_t slot(const Key &key) const {return (uint64_t)(Hash()(key) * 0x9E3779B97F4A7C15ULL) >> shift;};
+    size_t mask;
+    int shift;
+    Slot *slots;
+  };
+
+  static const Value* tombstone() {
+    static const char deleted = 0;
+    return reinterpret_cast<const Value*>(&deleted);
+  };
+
+  size_t capacity() const {
+    const Table *t = table.load(std::memory_order_relaxed);
+    return (t == nullptr) ? 0 : t->mask + 1;
+  };
+
+  static size_t probe(const Table* t, const Key &key) {
+    size_t i = t->slot(key);
+    while (t->slots[i].value.load(std::memory_order_relaxed) != nullptr and !(t->slots[i].key == key))
+      i = (i + 1) & t->mask;
+    return i;
+  };
+
+  void rebuild(const size_t &n) {
+    // at most half full afterwards, without the tombstones
+    size_t capacity = 16;
+    while (capacity < 2 * n)
+      capacity *= 2;
+    Table *old = table.load(std::memory_order_relaxed), *t = new Table(capacity);
+    for (size_t i = 0; old != nullptr and i <= old->mask; i++) {
+      const Value *value = old->slots[i].value.load(std::memory_order_relaxed);
+      if (value != nullptr and value != tombstone()) {
+        Slot &s = t->slots[probe(t, old->slots[i].key)];
+        s.key = old->slots[i].key;
+        s.value.store(value, std::memory_order_relaxed);
+      }
+    }
+    used = count;
+    table.store(t);
+    if (old != nullptr)
+      retired.push_back(std::make_pair(write_version, old));
+  };
+
+  TwoDITHashMap(const TwoDITHashMap&);
+  TwoDITHashMap& operator=(const TwoDITHashMap&);
+
+  std::atomic<Table*> table;
+  size_t count, used;
+  uint64_t write_version;
+  std::deque<std::pair<uint64_t, Table*> > retired;
+};
+
+
+#endif
@@ -0,0 +1,315 @@
+#include "TwoDITImage.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// image layout: header, node array in low point order, node indices in id order, string heap
+struct TwoDITImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t root;
+  uint64_t count;
+  uint64_t heap_size;
+};
+
+static const char kImageMagic[8] = {'2', 'D', 'I', 'T', 'I', 'M', 'G', '\0'};
+static const uint32_t kImageVersion = 4;
+
+
+//
+static size_t imageLength(const uint64_t &count, const uint64_t &heap_size) {
+
+return sizeof(TwoDITImageHeader) + count * (sizeof(TwoDITImageNode) + sizeof(uint32_t)) + heap_size;
+};
+
+
+//
+static int compareBytes(const char *a, const size_t &a_len, const char *b, const size_t &b_len) {
+
+// same ordering as std::string::compare
+int r = memcmp(a, b, std::min(a_len, b_len));
+
+if (r != 0)
+  return r;
+
+return (a_len < b_len) ? -1 : (a_len > b_len);
+};
+
+
+//
+static uint32_t buildImage(TwoDITImageNode *nodes, const char *heap, const uint32_t &lo, const uint32_t &hi) {
+
+if (lo >= hi)
+  return TwoDITImage::nil;
+
+// balanced over the sorted array, so each sub-tree is a contiguous range of nodes
+uint32_t mid = lo + (hi - lo) / 2;
+TwoDITImageNode &x = nodes[mid];
+
+x.left = buildImage(nodes, heap, lo, mid);
+x.right = buildImage(nodes, heap, mid + 1, hi);
+x.max_high = mid;
+x.min_low = lo;
+x.max_timestamp = x.timestamp;
+x.min_timestamp = x.timestamp;
+
+uint32_t children[2] = {x.left, x.right};
+
+for (int c = 0; c < 2; c++) {
+  if (children[c] != TwoDITImage::nil) {
+    const TwoDITImageNode &y = nodes[children[c]], &m = nodes[y.max_high], &n = nodes[x.max_high];
+
+    if (compareBytes(heap + m.high_off, m.high_len, heap + n.high_off, n.high_len) > 0)
+      x.max_high = y.max_high;
+    if (y.max_timestamp > x.max_timestamp)
+      x.max_timestamp = y.max_timestamp;
+    if (y.min_timestamp < x.min_timestamp)
+      x.min_timestamp = y.min_timestamp;
+  }
+}
+
+return mid;
+};
+
+
+//
+TwoDITImage::TwoDITImage() : base(nullptr), length(0), nodes(nullptr), id_index(nullptr), heap(nullptr) {};
+
+
+//
+TwoDITImage::~TwoDITImage() {
+
+close();
+};
+
+
+//
+bool TwoDITImage::write(const std::string &filename, const std::vector<TwoDITImageRecord> &records) {
+
+uint64_t count = records.size(), heap_size = 0;
+
+if (count >= nil)
+  return false;
+
+for (std::vector<TwoDITImageRecord>::const_iterator it = records.begin(); it != records.end(); it++) {
+  heap_size += it->id.size() + it->low.size() + it->high.size();
+}
+
+// the image is laid out directly in a mapping of the output file, so exporting needs no
+// buffer beyond the page cache
+std::string tmp_file = filename + ".tmp";
+size_t len = imageLength(count, heap_size);
+int fd = ::open(tmp_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+if (fd < 0)
+  return false;
+
+if (ftruncate(fd, len) != 0) {
+  ::close(fd);
+  std::remove(tmp_file.c_str());
+  return false;
+}
+
+char *out = (char *)mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+if (out == MAP_FAILED) {
+  ::close(fd);
+  std::remove(tmp_file.c_str());
+  return false;
+}
+
+TwoDITImageHeader *header = (TwoDITImageHeader *)out;
+TwoDITImageNode *out_nodes = (TwoDITImageNode *)(out + sizeof(TwoDITImageHeader));
+uint32_t *out_index = (uint32_t *)(out_nodes + count);
+char *out_heap = (char *)(out_index + count);
+uint64_t off = 0;
+
+for (uint32_t i = 0; i < count; i++) {
+  const TwoDITImageRecord &record = records[i];
+  TwoDITImageNode &x = out_nodes[i];
+  const std::string &id = record.id, &low = record.low, &high = record.high;
+
+  x.id_off = off;
+  x.id_len = id.size();
+  memcpy(out_heap + off, id.data(), id.size());
+  off += id.size();
+
+  x.low_off = off;
+  x.low_len = low.size();
+  memcpy(out_heap + off, low.data(), low.size());
+  off += low.size();
+
+  x.high_off = off;
+  x.high_len = high.size();
+  memcpy(out_heap + off, high.data(), high.size());
+  off += high.size();
+
+  x.timestamp = record.timestamp;
+}
+
+memcpy(header->magic, kImageMagic, sizeof(kImageMagic));
+header->version = kImageVersion;
+header->count = count;
+header->heap_size = heap_size;
+header->root = buildImage(out_nodes, out_heap, 0, count);
+
+for (uint32_t i = 0; i < count; i++)
+  out_index[i] = i;
+
+std::sort(out_index, out_index + count, [out_nodes, out_heap](const uint32_t &a, const uint32_t &b) {
+  return compareBytes(out_heap + out_nodes[a].id_off, out_nodes[a].id_len, out_heap + out_nodes[b].id_off, out_nodes[b].id_len) < 0;
+});
+
+bool ok = (msync(out, len, MS_SYNC) == 0);
+ok = (munmap(out, len) == 0) and ok;
+ok = (fsync(fd) == 0) and ok;
+ok = (::close(fd) == 0) and ok;
+
+if (!ok or std::rename(tmp_file.c_str(), filename.c_str()) != 0) {
+  std::remove(tmp_file.c_str());
+  return false;
+}
+
+return true;
+};
+
+
+//
+bool TwoDITImage::open(const std::string &filename) {
+
+close();
+
+int fd = ::open(filename.c_str(), O_RDONLY);
+
+if (fd < 0)
+  return false;
+
+struct stat st;
+
+if (fstat(fd, &st) != 0 or st.st_size < (off_t)sizeof(TwoDITImageHeader)) {
+  ::close(fd);
+  return false;
+}
+
+void *in = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+::close(fd);
+
+if (in == MAP_FAILED)
+  return false;
+
+const TwoDITImageHeader *header = (const TwoDITImageHeader *)in;
+
+if (memcmp(header->magic, kImageMagic, sizeof(kImageMagic)) != 0 or header->version != kImageVersion
+    or header->count >= nil or imageLength(header->count, header->heap_size) != (size_t)st.st_size) {
+  munmap(in, st.st_size);
+  return false;
+}
+
+base = (char *)in;
+length = st.st_size;
+nodes = (const TwoDITImageNode *)(base + sizeof(TwoDITImageHeader));
+id_index = (const uint32_t *)(nodes + header->count);
+heap = (const char *)(id_index + header->count);
+
+return true;
+};
+
+
+//
+void TwoDITImage::close() {
+
+if (base != nullptr) {
+  munmap(base, length);
+  base = nullptr;
+  length = 0;
+  nodes = nullptr;
+  id_index = nullptr;
+  heap = nullptr;
+}
+};
+
+
+//
+uint32_t TwoDITImage::size() const {
+
+return isOpen() ? ((const TwoDITImageHeader *)base)->count : 0;
+};
+
+
+//
+uint32_t TwoDITImage::root() const {
+
+return isOpen() ? ((const TwoDITImageHeader *)base)->root : nil;
+};
+
+
+//
+void TwoDITImage::getInterval(std::string &id, std::string &low, std::string &high, uint64_t &timestamp, const uint32_t &i) const {
+
+const TwoDITImageNode &x = nodes[i];
+
+id.assign(heap + x.id_off, x.id_len);
+low.assign(heap + x.low_off, x.low_len);
+high.assign(heap + x.high_off, x.high_len);
+timestamp = x.timestamp;
+};
+
+
+//
+bool TwoDITImage::find(uint32_t &i, const std::string &id) const {
+
+const uint32_t *end = id_index + size();
+const uint32_t *it = std::lower_bound(id_index, end, id, [this](const uint32_t &a, const std::string &key) {
+  return compareBytes(heap + nodes[a].id_off, nodes[a].id_len, key.data(), key.size()) < 0;
+});
+
+if (it == end or compareBytes(heap + nodes[*it].id_off, nodes[*it].id_len, id.data(), id.size()) != 0)
+  return false;
+
+i = *it;
+return true;
+};
+
+
+//
+int TwoDITImage::compareLow(const uint32_t &i, const std::string &key) const {
+
+return compareBytes(heap + nodes[i].low_off, nodes[i].low_len, key.data(), key.size());
+};
+
+
+//
+int TwoDITImage::compareHigh(const uint32_t &i, const std::string &key) const {
+
+return compareBytes(heap + nodes[i].high_off, nodes[i].high_len, key.data(), key.size());
+};
+
+
+//
+int TwoDITImage::compareMaxHigh(const uint32_t &i, const std::string &key) const {
+
+return compareHigh(nodes[i].max_high, key);
+};
+
+
+//
+int TwoDITImage::compareMinLow(const uint32_t &i, const std::string &key) const {
+
+return compareLow(nodes[i].min_low, key);
+};
+
+
+//
+bool TwoDITImage::overlaps(const uint32_t &i, const std::string &low, const std::string &high) const {
+
+// point intersections are considered intersections, as in TwoDInterval::operator*
+if (compareLow(i, low) < 0)
+  return compareHigh(i, low) >= 0;
+
+return compareLow(i, high) <= 0;
+};
@@ -0,0 +1,68 @@
+#ifndef TWOD_IT_IMAGE_H
+#define TWOD_IT_IMAGE_H
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+
+
+
+// one interval to write into an image, id and keys already in their byte encoding
+struct TwoDITImageRecord {
+  std::string id, low, high;
+  uint64_t timestamp;
+};
+
+// Node of a flat interval tree image. Strings live in the image's heap and
+// children are node indices, so the file can be mapped and queried in place.
+struct TwoDITImageNode {
+  uint64_t id_off, low_off, high_off;
+  uint64_t timestamp, max_timestamp, min_timestamp;
+  uint32_t id_len, low_len, high_len;
+  uint32_t max_high; // index of the node holding the sub-tree's largest high point
+  uint32_t min_low; // index of the sub-tree's leftmost node
+  uint32_t left, right;
+};
+
+
+// Read-only, memory-mapped image of an interval tree
+class TwoDITImage {
+public:
+  TwoDITImage();
+  ~TwoDITImage();
+
+  static bool write(const std::string &filename, const std::vector<TwoDITImageRecord> &records);
+
+  bool open(const std::string &filename);
+  void close();
+  bool isOpen() const {return base != nullptr;};
+
+  uint32_t size() const;
+  uint32_t root() const;
+  const TwoDITImageNode &node(const uint32_t &i) const {return nodes[i];};
+
+  void getInterval(std::string &id, std::string &low, std::string &high, uint64_t &timestamp, const uint32_t &i) const;
+  bool find(uint32_t &i, const std::string &id) const;
+
+  int compareLow(const uint32_t &i, const std::string &key) const;
+  int compareHigh(const uint32_t &i, const std::string &key) const;
+  int compareMaxHigh(const uint32_t &i, const std::string &key) const;
+  int compareMinLow(const uint32_t &i, const std::string &key) const;
+  bool overlaps(const uint32_t &i, const std::string &low, const std::string &high) const;
+
+  static const uint32_t nil = 0xFFFFFFFF;
+
+private:
+
+  TwoDITImage(const TwoDITImage&);
+  TwoDITImage& operator=(const TwoDITImage&);
+
+  char *base;
+  size_t length;
+  const TwoDITImageNode *nodes;
+  const uint32_t *id_index;
+  const char *heap;
+};
+
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef TWOD_IT_POOL_H
+#define TWOD_IT_POOL_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+
+// Slab allocator for objects of one type. Objects are carved out of large slabs in
+// allocation order, and destroyed ones are kept on a free list for reuse, so steady
+// insert/delete churn stops going to the heap. Single-threaded, like the store's writer.
+template <typename T>
+class TwoDITPool {
+public:
+  TwoDITPool(const size_t &slab_size = 4096) : slab_size(slab_size), next(0), free_list(nullptr), live(0) {};
+  ~TwoDITPool() {release();};
+
+  template <typename... Args>
+  T* create(Args&&... args) {
+    T *x = new (allocate()) T(std::forward<Args>(args)...);
+    live++;
+    return x;
+  };
+
+  void destroy(const T* x) {
+    x->~T();
+    Slot *s = reinterpret_cast<Slot*>(const_cast<T*>(x));
+    s->next = free_list;
+    free_list = s;
+    live--;
+  };
+
+  // drops every slab at once; objects still alive must be trivially destructible or already
+  // destroyed by the caller
+  void release() {
+    for (typename std::vector<Slot*>::iterator it = slabs.begin(); it != slabs.end(); it++)
+      ::operator delete(*it);
+    slabs.clear();
+    next = slab_size;
+    free_list = nullptr;
+    live = 0;
+  };
+
+  size_t size() const {return live;};
+  size_t capacity() const {return slabs.size() * slab_size;};
+
+private:
+
+  union Slot {
+    Slot *next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  void* allocate() {
+    if (free_list != nullptr) {
+      Slot *s = free_list;
+      free_list = s->next;
+      return s;
+    }
+
+    if (slabs.empty() or next == slab_size) {
+      slabs.push_back(static_cast<Slot*>(::operator new(slab_size * sizeof(Slot))));
+      next = 0;
+    }
+
+    return &slabs.back()[next++];
+  };
+
+  TwoDITPool(const TwoDITPool&);
+  TwoDITPool& operator=(const TwoDITPool&);
+
+  size_t slab_size, next;
+  Slot *free_list;
+  size_t live;
+  std::vector<Slot*> slabs;
+};
+
+
+#endif
@@ -0,0 +1,533 @@
+#include "TwoDITSharded.h"
+#include <algorithm>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+
+// a rebalance splits the shards by this many sampled low points per shard
+static const size_t kSamplesPerShard = 256;
+
+
+//
+template <typename Key, typename Compare>
+TwoDITShardedT<Key, Compare>::TwoDITShardedT(const unsigned &shards, const TwoDITEngine &engine) : engine(engine) {
+
+setDefaults(shards);
+};
+
+
+//
+template <typename Key, typename Compare>
+TwoDITShardedT<Key, Compare>::TwoDITShardedT(const unsigned &shards, const std::vector<Key> &sample, const TwoDITEngine &engine) : engine(engine) {
+
+setDefaults(shards);
+
+std::vector<Key> keys(sample);
+chooseBounds(keys);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::setDefaults(const unsigned &shards) {
+
+query_threads = 1;
+pool_stop = false;
+
+for (unsigned s = 0; s < std::max(shards, 1u); s++) {
+  this->shards.push_back(createShard());
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+typename TwoDITShardedT<Key, Compare>::Shard* TwoDITShardedT<Key, Compare>::createShard() const {
+
+// nothing could reload a shard without the split, so none keeps a snapshot or log
+Shard *shard = new Shard(engine);
+shard->setSyncFile("");
+return shard;
+};
+
+
+//
+template <typename Key, typename Compare>
+TwoDITShardedT<Key, Compare>::~TwoDITShardedT() {
+
+{
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  pool_stop = true;
+}
+
+pool_wake.notify_all();
+
+for (std::vector<std::thread>::iterator it = pool.begin(); it != pool.end(); it++) {
+  it->join();
+}
+
+for (typename std::vector<Shard*>::iterator it = shards.begin(); it != shards.end(); it++) {
+  delete *it;
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::insertInterval(const TwoDITId &id, const Key &minKey, const Key &maxKey, const uint64_t &maxTimestamp) {
+
+unsigned first = shardOf(minKey), last = std::max(first, shardOf(maxKey));
+Placement old;
+
+// a rewritten id leaves the shards its new range no longer reaches
+if (takePlacement(old, id, Placement(first, last))) {
+  for (unsigned s = old.first; s <= old.second; s++) {
+    if (s < first or s > last)
+      shards[s]->deleteInterval(id);
+  }
+}
+
+for (unsigned s = first; s <= last; s++) {
+  shards[s]->insertInterval(id, minKey, maxKey, maxTimestamp);
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::bulkInsert(const std::vector<TwoDInterval> &intervals) {
+
+std::vector<std::vector<TwoDInterval> > parts(shards.size());
+std::unordered_map<TwoDITId, size_t, TwoDITIdHash> latest;
+
+// only the last interval given for an id is kept, as by the stores
+for (size_t i = 0; i < intervals.size(); i++) {
+  latest[intervals[i].GetId()] = i;
+}
+
+for (size_t i = 0; i < intervals.size(); i++) {
+  const TwoDInterval &interval = intervals[i];
+
+  if (interval.GetId().empty() or latest[interval.GetId()] != i)
+    continue;
+
+  unsigned first = shardOf(interval.GetLowPoint()), last = std::max(first, shardOf(interval.GetHighPoint()));
+  Placement old;
+
+  if (takePlacement(old, interval.GetId(), Placement(first, last))) {
+    for (unsigned s = old.first; s <= old.second; s++) {
+      if (s < first or s > last)
+        shards[s]->deleteInterval(interval.GetId());
+    }
+  }
+
+  for (unsigned s = first; s <= last; s++) {
+    parts[s].push_back(interval);
+  }
+}
+
+fanOut(0, shards.size() - 1, std::thread::hardware_concurrency(), [this, &parts](const unsigned &s) {
+  if (!parts[s].empty())
+    shards[s]->bulkInsert(parts[s]);
+});
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::deleteInterval(const TwoDITId &id) {
+
+Placement old;
+
+{
+  std::lock_guard<std::mutex> lock(placement_mutex);
+  typename std::unordered_map<uint64_t, std::unordered_map<uint64_t, Placement> >::iterator file = placements.find(id.file);
+
+  if (file == placements.end() or file->second.find(id.block) == file->second.end())
+    return;
+
+  old = file->second[id.block];
+  file->second.erase(id.block);
+
+  if (file->second.empty())
+    placements.erase(file);
+}
+
+for (unsigned s = old.first; s <= old.second; s++) {
+  shards[s]->deleteInterval(id);
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::deleteAllIntervals(const uint64_t &file) {
+
+unsigned first = shards.size(), last = 0;
+
+{
+  std::lock_guard<std::mutex> lock(placement_mutex);
+  typename std::unordered_map<uint64_t, std::unordered_map<uint64_t, Placement> >::iterator blocks = placements.find(file);
+
+  if (blocks == placements.end())
+    return;
+
+  for (typename std::unordered_map<uint64_t, Placement>::iterator it = blocks->second.begin(); it != blocks->second.end(); it++) {
+    first = std::min(first, it->second.first);
+    last = std::max(last, it->second.second);
+  }
+
+  placements.erase(blocks);
+}
+
+// only the shards some block of the file reaches
+for (unsigned s = first; s <= last; s++) {
+  shards[s]->deleteAllIntervals(file);
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TwoDITShardedT<Key, Compare>::takePlacement(Placement &ret_placement, const TwoDITId &id, const Placement &placement) {
+
+std::lock_guard<std::mutex> lock(placement_mutex);
+std::unordered_map<uint64_t, Placement> &blocks = placements[id.file];
+typename std::unordered_map<uint64_t, Placement>::iterator it = blocks.find(id.block);
+
+if (it == blocks.end()) {
+  blocks[id.block] = placement;
+  return false;
+}
+
+ret_placement = it->second;
+it->second = placement;
+return true;
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::getInterval(TwoDInterval &ret_interval, const TwoDITId &id) const {
+
+if (!findInterval(ret_interval, id))
+  ret_interval = TwoDInterval();
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TwoDITShardedT<Key, Compare>::findInterval(TwoDInterval &ret_interval, const TwoDITId &id) const {
+
+for (typename std::vector<Shard*>::const_iterator it = shards.begin(); it != shards.end(); it++) {
+  (*it)->getInterval(ret_interval, id);
+
+  if (!ret_interval.GetId().empty())
+    return true;
+}
+
+return false;
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey) const {
+
+visitOverlaps(minKey, maxKey, [&ret_value](const TwoDInterval &interval) {
+  ret_value.push_back(interval);
+  return true;
+});
+
+std::sort(ret_value.begin(), ret_value.end(), std::greater<TwoDInterval>());
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k) const {
+
+topK(ret_value, minKey, maxKey, k, 0, UINT64_MAX);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
+
+unsigned first = shardOf(minKey), last = std::max(first, shardOf(maxKey));
+
+if (first == last) {
+  shards[first]->topK(ret_value, minKey, maxKey, k, minTimestamp, maxTimestamp);
+  return;
+}
+
+std::vector<std::vector<TwoDInterval> > results(last - first + 1);
+
+fanOut(first, last, query_threads, [&](const unsigned &s) {
+  shards[s]->topK(results[s - first], minKey, maxKey, k, minTimestamp, maxTimestamp);
+});
+
+// each shard's k newest come newest first, and the k newest overall are among them; an
+// interval spanning shards is taken only from the first of them the query reaches
+std::vector<size_t> next(results.size(), 0);
+std::priority_queue<std::pair<uint64_t, size_t> > heads;
+std::function<void(const size_t&)> advance = [&](const size_t &i) {
+  while (next[i] < results[i].size() and i > 0 and shardOf(results[i][next[i]].GetLowPoint()) < first + i)
+    next[i]++;
+
+  if (next[i] < results[i].size())
+    heads.push(std::make_pair(results[i][next[i]].GetTimeStamp(), i));
+};
+
+for (size_t i = 0; i < results.size(); i++) {
+  advance(i);
+}
+
+for (uint32_t taken = 0; taken < k and !heads.empty(); taken++) {
+  size_t i = heads.top().second;
+  heads.pop();
+  ret_value.push_back(results[i][next[i]++]);
+  advance(i);
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::visitOverlaps(const Key &minKey, const Key &maxKey, const Visitor &visit) const {
+
+unsigned first = shardOf(minKey), last = std::max(first, shardOf(maxKey));
+bool stopped = false;
+
+// a later shard only adds the intervals starting in it, so low point order holds across shards
+for (unsigned s = first; s <= last and !stopped; s++) {
+  shards[s]->visitOverlaps(minKey, maxKey, [&](const TwoDInterval &interval) {
+    if (s > first and shardOf(interval.GetLowPoint()) < s)
+      return true;
+
+    stopped = !visit(interval);
+    return !stopped;
+  });
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey) const {
+
+Shard::groupByFile(ret_value, [this, &minKey, &maxKey](const Visitor &add) {
+  visitOverlaps(minKey, maxKey, add);
+});
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k) const {
+
+topKByFile(ret_value, minKey, maxKey, k, 0, UINT64_MAX);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
+
+Shard::groupByFile(ret_value, [&](const Visitor &add) {
+  std::vector<TwoDInterval> newest;
+  topK(newest, minKey, maxKey, k, minTimestamp, maxTimestamp);
+
+  for (typename std::vector<TwoDInterval>::iterator it = newest.begin(); it != newest.end(); it++) {
+    add(*it);
+  }
+});
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::setQueryThreads(const unsigned &threads) { query_threads = threads; };
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::getQueryThreads(unsigned &threads) const { threads = query_threads; };
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::getShardSizes(std::vector<uint64_t> &sizes) const {
+
+sizes.resize(shards.size());
+
+for (size_t s = 0; s < shards.size(); s++) {
+  shards[s]->getSize(sizes[s]);
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TwoDITShardedT<Key, Compare>::rebalance(const double &skew) {
+
+std::vector<uint64_t> sizes;
+getShardSizes(sizes);
+uint64_t total = 0, largest = 0;
+
+for (std::vector<uint64_t>::iterator it = sizes.begin(); it != sizes.end(); it++) {
+  total += *it;
+  largest = std::max(largest, *it);
+}
+
+if (shards.size() < 2 or total == 0 or largest <= skew * total / shards.size())
+  return false;
+
+// each interval once, from the shard its low point falls in
+std::vector<TwoDInterval> intervals;
+intervals.reserve(total);
+
+for (unsigned s = 0; s < shards.size(); s++) {
+  Key low, high;
+
+  if (!shards[s]->getKeyRange(low, high))
+    continue;
+
+  shards[s]->visitOverlaps(low, high, [this, &intervals, &s](const TwoDInterval &interval) {
+    if (shardOf(interval.GetLowPoint()) == s)
+      intervals.push_back(interval);
+    return true;
+  });
+}
+
+std::vector<Key> sample;
+size_t step = std::max<size_t>(1, intervals.size() / (kSamplesPerShard * shards.size()));
+
+for (size_t i = 0; i < intervals.size(); i += step) {
+  sample.push_back(intervals[i].GetLowPoint());
+}
+
+chooseBounds(sample);
+
+// the old shards keep no files, so dropping them costs no I/O
+for (unsigned s = 0; s < shards.size(); s++) {
+  delete shards[s];
+  shards[s] = createShard();
+}
+
+placements.clear();
+
+bulkInsert(intervals);
+return true;
+};
+
+
+//
+template <typename Key, typename Compare>
+unsigned TwoDITShardedT<Key, Compare>::shardOf(const Key &key) const {
+
+return std::upper_bound(bounds.begin(), bounds.end(), key, Compare()) - bounds.begin();
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::chooseBounds(std::vector<Key> &sample) {
+
+bounds.clear();
+
+if (sample.empty())
+  return;
+
+// equal shares of the sample; repeated keys may leave a shard empty
+std::sort(sample.begin(), sample.end(), Compare());
+
+for (size_t s = 1; s < shards.size(); s++) {
+  bounds.push_back(sample[sample.size() * s / shards.size()]);
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::fanOut(const unsigned &first, const unsigned &last, const unsigned &threads, const std::function<void(const unsigned&)> &work) const {
+
+unsigned count = last - first + 1;
+unsigned slices = (threads < 2) ? 1 : std::min(threads, count);
+std::function<void(unsigned, unsigned)> run = [&work](unsigned begin, unsigned end) {
+  for (unsigned s = begin; s < end; s++) {
+    work(s);
+  }
+};
+unsigned pending = slices - 1;
+
+if (pending > 0) {
+  std::lock_guard<std::mutex> lock(pool_mutex);
+
+  while (pool.size() < pending) {
+    pool.push_back(std::thread(&TwoDITShardedT::poolWork, this));
+  }
+
+  for (unsigned t = 1; t < slices; t++) {
+    unsigned begin = first + count * t / slices, end = first + count * (t + 1) / slices;
+
+    pool_tasks.push_back([this, &run, &pending, begin, end]() {
+      run(begin, end);
+      std::lock_guard<std::mutex> done(pool_mutex);
+
+      if (--pending == 0)
+        pool_done.notify_all();
+    });
+  }
+
+  pool_wake.notify_all();
+}
+
+run(first, first + count / slices);
+
+// a caller waiting on its slices runs queued ones, so fan-outs from many threads never all
+// wait on workers busy with each other's work
+std::unique_lock<std::mutex> lock(pool_mutex);
+
+while (pending > 0) {
+  if (pool_tasks.empty()) {
+    pool_done.wait(lock);
+    continue;
+  }
+
+  std::function<void()> task = pool_tasks.front();
+  pool_tasks.pop_front();
+  lock.unlock();
+  task();
+  lock.lock();
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITShardedT<Key, Compare>::poolWork() const {
+
+std::unique_lock<std::mutex> lock(pool_mutex);
+
+while (true) {
+  while (!pool_stop and pool_tasks.empty()) {
+    pool_wake.wait(lock);
+  }
+
+  if (pool_tasks.empty())
+    return;
+
+  std::function<void()> task = pool_tasks.front();
+  pool_tasks.pop_front();
+  lock.unlock();
+  task();
+  lock.lock();
+}
+};
+
+
+template class TwoDITShardedT<std::string>;
+template class TwoDITShardedT<uint64_t>;
+template class TwoDITShardedT<int64_t>;
+template class TwoDITShardedT<double>;
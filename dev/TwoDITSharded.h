@@ -0,0 +1,103 @@
+#ifndef TWOD_IT_SHARDED_H
+#define TWOD_IT_SHARDED_H
+
+#include "TwoDITwTopK.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <inttypes.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+
+// Intervals split by key range over several stores. Shard i covers the keys in
+// [bounds[i - 1], bounds[i]) and holds every interval reaching into them, so an interval
+// spanning a bound is stored in each shard it reaches; a query asks only the shards its
+// range reaches and keeps each interval from one of them. Writers meet only in the shards
+// they share, and each shard lets its readers in without a lock. Neither the shards nor the
+// split are saved, so the index is rebuilt, not reloaded.
+template <typename Key, typename Compare = std::less<Key> >
+class TwoDITShardedT {
+public:
+  typedef TwoDIntervalT<Key, Compare> TwoDInterval;
+  typedef TwoDITwTopKT<Key, Compare> Shard;
+  typedef typename Shard::Visitor Visitor;
+
+  // without a sample of keys to split by, everything goes to the first shard until rebalance()
+  explicit TwoDITShardedT(const unsigned &shards, const TwoDITEngine &engine = ENGINE_RBTREE);
+  TwoDITShardedT(const unsigned &shards, const std::vector<Key> &sample, const TwoDITEngine &engine = ENGINE_RBTREE);
+  ~TwoDITShardedT();
+
+  // writes of one id are not to race each other; one spanning several shards reaches them in turn
+  void insertInterval(const TwoDITId &id, const Key &minKey, const Key &maxKey, const uint64_t &maxTimestamp);
+  void bulkInsert(const std::vector<TwoDInterval> &intervals);
+
+  void deleteInterval(const TwoDITId &id);
+  void deleteAllIntervals(const uint64_t &file);
+
+  void getInterval(TwoDInterval &ret_interval, const TwoDITId &id) const;
+  void topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey) const;
+  void topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k) const;
+  void topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+  void visitOverlaps(const Key &minKey, const Key &maxKey, const Visitor &visit) const;
+
+  // the same results grouped by file, files newest first
+  void topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey) const;
+  void topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k) const;
+  void topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+
+  // with threads > 1 a top-k query asks its shards in parallel, on workers the index starts
+  // once and keeps, which pays off for large k
+  void setQueryThreads(const unsigned &threads);
+  void getQueryThreads(unsigned &threads) const;
+  void getShardSizes(std::vector<uint64_t> &sizes) const;
+
+  // if the largest shard holds more than skew times the average, picks new bounds from a
+  // sample of the low points and moves every interval; like openImage, not to race any other call
+  bool rebalance(const double &skew = 2.0);
+
+private:
+
+  // the first and last shard an id's range reaches
+  typedef std::pair<unsigned, unsigned> Placement;
+
+  void setDefaults(const unsigned &shards);
+  Shard* createShard() const;
+  unsigned shardOf(const Key &key) const;
+  void chooseBounds(std::vector<Key> &sample);
+  bool findInterval(TwoDInterval &ret_interval, const TwoDITId &id) const;
+  bool takePlacement(Placement &ret_placement, const TwoDITId &id, const Placement &placement);
+  void fanOut(const unsigned &first, const unsigned &last, const unsigned &threads, const std::function<void(const unsigned&)> &work) const;
+  void poolWork() const;
+
+  TwoDITShardedT(const TwoDITShardedT&);
+  TwoDITShardedT& operator=(const TwoDITShardedT&);
+
+  TwoDITEngine engine;
+  std::vector<Shard*> shards;
+  std::vector<Key> bounds; // ascending, one between each two shards, or none before a first split
+  std::atomic<unsigned> query_threads;
+
+  // fan-out workers: each keeps its reader records in the shards from one query to the next
+  mutable std::vector<std::thread> pool;
+  mutable std::deque<std::function<void()> > pool_tasks;
+  mutable std::mutex pool_mutex;
+  mutable std::condition_variable pool_wake, pool_done;
+  mutable bool pool_stop;
+
+  // where each stored id went, by file and then block, so a write asks only the shards it
+  // changes; queries take no lock and do not use it
+  std::unordered_map<uint64_t, std::unordered_map<uint64_t, Placement> > placements;
+  std::mutex placement_mutex;
+};
+
+typedef TwoDITShardedT<std::string> TwoDITSharded;
+
+
+#endif
@@ -1,28 +1,442 @@
 
 #include "TwoDITwTopK.h"
+#include "zen.pb.h"
+#include <cstdio>
 #include <deque>
 #include <exception>
+#include <fcntl.h>
 #include <functional>
 #include <fstream>
 #include <iomanip>
+#include <iterator>
 #include <iostream>
-#include <list>
+#include <mutex>
 #include <sstream>
+#include <sys/stat.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
 #include <utility>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+
+
+// sync files are a stream of length-delimited ZenDurability.Interval records, each
+// tagged as field 1 of ZenDurability.IntervalSet, so a whole file also parses as one IntervalSet
+static const uint32_t kIntervalTag = (ZenDurability::IntervalSet::kIntervalFieldNumber << 3) | 2;
+
+// log records are framed as fixed32 crc32c of the payload, fixed32 payload size, then a
+// serialized ZenDurability.LogRecord
+static const size_t kLogHeaderSize = 8;
+static const uint32_t kLogMaxRecordSize = 1 << 26;
+
+// below this many intervals a bulk load sorts on the calling thread only
+static const size_t kParallelSortMin = 1 << 16;
+
+// a batch writing more than one in this many stored intervals rebuilds the tree
+static const size_t kRebuildShare = 8;
+
+// entries a thread keeps for stores it has read before it looks for destroyed ones
+static const size_t kThreadReadsSweep = 16;
+
+
+//
+static bool parseNumber(uint64_t &n, const std::string &s, const size_t &begin, const size_t &end) {
+
+if (begin == end)
+  return false;
+
+n = 0;
+
+for (size_t i = begin; i < end; i++) {
+  if (s[i] < '0' or s[i] > '9')
+    return false;
+  
+  uint64_t d = s[i] - '0';
+  
+  // kNone is reserved for "no block", so it is out of range too
+  if (n > (TwoDITId::kNone - 1 - d) / 10)
+    return false;
+  
+  n = n * 10 + d;
+}
+
+return true;
+};
+
+
+//
+template <typename Record>
+static void setRecordId(Record *record, const TwoDITId &id) {
+
+record->set_file(id.file);
+
+// records are reused from one id to the next, so a block left from the last one must go
+if (id.hasBlock())
+  record->set_block(id.block);
+else
+  record->clear_block();
+};
+
+
+//
+template <typename Key>
+static void setRecordOp(ZenDurability::LogRecord *record, const typename TwoDITWriteBatchT<Key>::Op &op) {
+
+typedef TwoDITWriteBatchT<Key> WriteBatch;
+std::string buf;
+
+switch (op.type) {
+  case WriteBatch::INSERT:
+    record->set_type(ZenDurability::LogRecord::INSERT);
+    setRecordId(record->mutable_interval(), op.id);
+    record->mutable_interval()->set_low(TwoDITKeyTraits<Key>::encode(op.low, buf));
+    record->mutable_interval()->set_high(TwoDITKeyTraits<Key>::encode(op.high, buf));
+    record->mutable_interval()->set_timestamp(op.timestamp);
+    break;
+  case WriteBatch::DELETE:
+    record->set_type(ZenDurability::LogRecord::DELETE);
+    setRecordId(record, op.id);
+    break;
+  case WriteBatch::DELETE_FILE:
+    record->set_type(ZenDurability::LogRecord::DELETE_PREFIX);
+    setRecordId(record, TwoDITId(op.id.file));
+    break;
+}
+};
+
+
+//
+template <typename Record>
+static bool getRecordId(TwoDITId &id, const Record &record, const char &delim) {
+
+// records from older versions only carry the string id
+if (!record.has_file())
+  return TwoDITId::parse(id, record.id(), delim);
+
+id = TwoDITId(record.file(), record.has_block() ? record.block() : TwoDITId::kNone);
+return !id.empty();
+};
+
+
+//
+template <typename Key>
+static void getRecordOp(typename TwoDITWriteBatchT<Key>::Op &op, const ZenDurability::LogRecord &record, const char &delim) {
+
+typedef TwoDITWriteBatchT<Key> WriteBatch;
+bool valid = false;
+
+switch (record.type()) {
+  case ZenDurability::LogRecord::INSERT:
+    op.type = WriteBatch::INSERT;
+    valid = getRecordId(op.id, record.interval(), delim);
+    op.low = TwoDITKeyTraits<Key>::decode(record.interval().low());
+    op.high = TwoDITKeyTraits<Key>::decode(record.interval().high());
+    op.timestamp = record.interval().timestamp();
+    break;
+  case ZenDurability::LogRecord::DELETE:
+    op.type = WriteBatch::DELETE;
+    valid = getRecordId(op.id, record, delim);
+    break;
+  case ZenDurability::LogRecord::DELETE_PREFIX:
+    op.type = WriteBatch::DELETE_FILE;
+    valid = getRecordId(op.id, record, delim);
+    break;
+  case ZenDurability::LogRecord::BATCH:
+    break;
+}
+
+if (!valid)
+  throw std::runtime_error("Malformed interval ID");
+};
+
+
+//
+static void idBytes(std::string &bytes, const TwoDITId &id) {
+
+// big-endian file then block, so images keep ids in id order
+std::string buf;
+bytes = TwoDITKeyTraits<uint64_t>::encode(id.file, buf);
+bytes += TwoDITKeyTraits<uint64_t>::encode(id.block, buf);
+};
+
+
+//
+static TwoDITId idFromBytes(const std::string &bytes) {
+
+if (bytes.size() != 16)
+  throw std::runtime_error("Corrupt interval ID");
+
+return TwoDITId(TwoDITKeyTraits<uint64_t>::decode(bytes.substr(0, 8)), TwoDITKeyTraits<uint64_t>::decode(bytes.substr(8)));
+};
+
+
+//
+const uint64_t TwoDITId::kNone;
+
+
+//
+std::string TwoDITId::str(const char &delim) const {
+
+if (empty())
+  return std::string();
+
+if (!hasBlock())
+  return std::to_string(file);
+
+return std::to_string(file) + delim + std::to_string(block);
+};
+
+
+//
+bool TwoDITId::parse(TwoDITId &id, const std::string &s, const char &delim) {
+
+size_t pos = s.find(delim);
+
+if (pos == std::string::npos) {
+  id.block = kNone;
+  return parseNumber(id.file, s, 0, s.size());
+}
+
+return parseNumber(id.file, s, 0, pos) and parseNumber(id.block, s, pos + 1, s.size());
+};
+
+
+//
+std::ostream& operator << (std::ostream &os, const TwoDITId &id) {
+
+return os<<id.str();
+};
+
+//
+static std::vector<uint32_t> crc32cTable() {
+
+std::vector<uint32_t> table(256);
+
+for (uint32_t i = 0; i < 256; i++) {
+  uint32_t c = i;
+  for (int k = 0; k < 8; k++)
+    c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+  table[i] = c;
+}
+
+return table;
+};
+
+
+//
+static uint32_t crc32c(const std::string &data) {
+
+static const std::vector<uint32_t> table = crc32cTable();
+uint32_t c = 0xFFFFFFFF;
+
+for (std::string::const_iterator it = data.begin(); it != data.end(); it++)
+  c = table[(c ^ (uint8_t)*it) & 0xFF] ^ (c >> 8);
+
+return c ^ 0xFFFFFFFF;
+};
+
+
+//
+static void encodeFixed32(char *buf, const uint32_t &value) {
+
+for (int i = 0; i < 4; i++)
+  buf[i] = (char)((value >> (8 * i)) & 0xFF);
+};
+
+
+//
+static uint32_t decodeFixed32(const char *buf) {
+
+uint32_t value = 0;
+
+for (int i = 0; i < 4; i++)
+  value |= ((uint32_t)(uint8_t)buf[i]) << (8 * i);
+
+return value;
+};
+
+
+//
+static bool writeAll(const int &fd, const std::string &data) {
+
+size_t done = 0;
+
+while (done < data.size()) {
+  ssize_t n = write(fd, data.data() + done, data.size() - done);
+  if (n < 0)
+    return false;
+  done += n;
+}
+
+return true;
+};
+
+
+//
+static std::mutex& liveStoresMutex() {
+
+static std::mutex mutex;
+return mutex;
+};
+
+
+//
+static std::unordered_set<uint64_t>& liveStores() {
+
+// ids of the stores not yet destroyed, so an exiting thread only touches records that exist
+static std::unordered_set<uint64_t> stores;
+return stores;
+};
 
 
 //
-static void split(std::list<std::string> &elems, const std::string &s, const char &delim) {
-//based on http://stackoverflow.com/a/236803
+static uint64_t storeRegister() {
 
-std::stringstream ss(s);
-std::string item1, item2;
+// one count for every key type, so a store at a recycled address, or of another type,
+// is never taken for an earlier one
+static uint64_t last_id = 0;
+std::lock_guard<std::mutex> lock(liveStoresMutex());
 
-std::getline(ss, item1, delim);
-elems.push_back(item1);
+liveStores().insert(++last_id);
+return last_id;
+};
+
+
+//
+static void storeUnregister(const uint64_t &store_id) {
+
+std::lock_guard<std::mutex> lock(liveStoresMutex());
+liveStores().erase(store_id);
+};
+
+
+// the reader records a thread holds for its queries, one per store it has read; each stays
+// claimed by the thread, so a query neither searches for a record nor competes for one
+struct TwoDITThreadReads {
+  struct Entry {
+    uint64_t store_id;
+    TwoDITReader *reader;
+    uint32_t depth; // nested queries share the outermost one's announcement
+  };
+  
+  TwoDITThreadReads() : sweep_at(kThreadReadsSweep) {};
+  
+  // entries for stores destroyed since are dropped once the list has doubled, so a thread
+  // reading many short-lived stores keeps about as many as are alive
+  void add(const Entry &entry) {
+    if (entries.size() >= sweep_at) {
+      std::lock_guard<std::mutex> lock(liveStoresMutex());
+      size_t kept = 0;
+      for (size_t i = 0; i < entries.size(); i++) {
+        if (liveStores().count(entries[i].store_id) > 0)
+          entries[kept++] = entries[i];
+      }
+      entries.resize(kept);
+      sweep_at = std::max(kThreadReadsSweep, 2 * kept);
+    }
+    entries.push_back(entry);
+  };
+  
+  Entry* find(const uint64_t &store_id) {
+    for (std::vector<Entry>::iterator it = entries.begin(); it != entries.end(); it++) {
+      if (it->store_id == store_id)
+        return &*it;
+    }
+    return nullptr;
+  };
+  
+  // the records go back to the stores still alive when the thread exits
+  ~TwoDITThreadReads() {
+    std::lock_guard<std::mutex> lock(liveStoresMutex());
+    for (std::vector<Entry>::iterator it = entries.begin(); it != entries.end(); it++) {
+      if (liveStores().count(it->store_id) > 0)
+        it->reader->claimed.store(false, std::memory_order_release);
+    }
+  };
+  
+  std::vector<Entry> entries;
+  size_t sweep_at;
+};
+
+static thread_local TwoDITThreadReads thread_reads;
+
+
+//
+template <typename Item>
+static bool heapCompareItem(const Item &a, const Item &b) {
+
+return a.priority < b.priority;
+};
+
+
+//
+static bool timeOverlaps(const uint64_t &min_timestamp, const uint64_t &max_timestamp, const uint64_t &lo, const uint64_t &hi) {
+
+// [min_timestamp, max_timestamp] meets the window [lo, hi]
+return min_timestamp <= hi and lo <= max_timestamp;
+};
+
+
+//
+template <typename Interval>
+static bool lowerInterval(const Interval *a, const Interval *b) {
 
-std::getline(ss, item2);
-elems.push_back(item2);
+// ids break ties between equal low points, so every interval has one place in the tree
+if (Interval::lower(a->GetLowPoint(), b->GetLowPoint()))
+  return true;
+
+if (Interval::lower(b->GetLowPoint(), a->GetLowPoint()))
+  return false;
+
+return a->GetId() < b->GetId();
+};
+
+
+//
+template <typename Interval, typename Ref>
+static bool lowerKeyed(const Ref &a_low, const Interval *a, const Ref &b_low, const Interval *b) {
+
+// lowerInterval, with the low points already in hand as references
+if (Interval::lowerRef(a_low, b_low))
+  return true;
+
+if (Interval::lowerRef(b_low, a_low))
+  return false;
+
+return a->GetId() < b->GetId();
+};
+
+
+//
+template <typename Interval, typename Node, typename Ref>
+static bool nodeOverlaps(const Node *x, const Ref &low, const Ref &high) {
+
+// point intersections are considered intersections, as in TwoDInterval::operator*
+if (Interval::lowerRef(x->low, low))
+  return !Interval::lowerRef(x->high, low);
+
+return !Interval::lowerRef(high, x->low);
+};
+
+
+//
+template <typename Interval>
+static void parallelSort(typename std::vector<const Interval*>::iterator first, typename std::vector<const Interval*>::iterator last, const unsigned &threads) {
+
+if (threads < 2 or (size_t)(last - first) < kParallelSortMin) {
+  std::sort(first, last, lowerInterval<Interval>);
+  return;
+}
+
+// sort the halves concurrently, then merge
+typename std::vector<const Interval*>::iterator middle = first + (last - first) / 2;
+std::thread t(parallelSort<Interval>, first, middle, threads / 2);
+
+parallelSort<Interval>(middle, last, threads - threads / 2);
+t.join();
+
+std::inplace_merge(first, middle, last, lowerInterval<Interval>);
 };
 
 
@@ -56,7 +470,47 @@ return c;
 
 
 //
-void TwoDITwTopK::setDefaults() {
+template <typename T>
+static T min2(const T &a, const T &b) {
+if (a<b) {
+  return a;
+}
+
+return b;
+};
+
+
+//
+template <typename T>
+static T min3(const T &a, const T &b, const T &c) {
+
+return min2<T>(min2<T>(a, b), c);
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+static typename KeyTraits::Ref maxHigh2(const typename KeyTraits::Ref &a, const typename KeyTraits::Ref &b) {
+
+// compares the keys but hands back the reference, so no key is ever copied
+if (Interval::lowerRef(b, a))
+  return a;
+
+return b;
+};
+
+
+//
+template <typename Interval, typename KeyTraits>
+static typename KeyTraits::Ref maxHigh3(const typename KeyTraits::Ref &a, const typename KeyTraits::Ref &b, const typename KeyTraits::Ref &c) {
+
+return maxHigh2<Interval, KeyTraits>(maxHigh2<Interval, KeyTraits>(a, b), c);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::setDefaults() {
 
 // set default values
 id_delim = '+';
@@ -65,415 +519,2485 @@ sync_threshold = 10000;
 sync_counter = 0;
 sync_file = "interval.str";
 
+log_mode = false;
+log_fd = -1;
+log_size = 0;
+fsync_policy = FSYNC_PER_OP;
+fsync_n = 1;
+log_unsynced = 0;
+flush_stop = false;
+
+engine = ENGINE_RBTREE;
 root = &nil;
 nil.is_red = false;
+write_version = 1;
+frozen_version = 0;
+published = nullptr;
+published_version = 0;
+readers = nullptr;
 
-iterator_in_use = false;
-iterator = nullptr;
+store_id = storeRegister();
 
-storage.reserve(1000000);
+background_sync = true;
+sync_running = false;
+write_sequence = 0;
+synced_sequence = 0;
+
+sync_reader = nullptr;
 
 //std::ofstream o1("perf.log");
 };
 
 
 //
-TwoDITwTopK::TwoDITwTopK() {
+template <typename Key, typename Compare>
+TwoDITwTopKT<Key, Compare>::TwoDITwTopKT(const TwoDITEngine &engine) {
 
 setDefaults();
+this->engine = engine;
+publish();
 };
 
 
 //
-TwoDITwTopK::TwoDITwTopK(const std::string &filename, const bool &sync_from_file) {
+template <typename Key, typename Compare>
+TwoDITwTopKT<Key, Compare>::TwoDITwTopKT(const std::string &filename, const bool &sync_from_file, const TwoDITEngine &engine) {
 
 setDefaults();
+this->engine = engine;
 sync_file = filename;
 
 if (sync_from_file) {
-  std::ifstream ifile(filename.c_str());
-
-  if (ifile.is_open()) {
+  syncLoad(filename);
   
-  std::list<TwoDInterval> l;
+  // a background sync that never finished leaves the log it rotated out behind
+  std::string old_log = filename + ".log.old";
+  struct stat st;
+  bool old_exists = (stat(old_log.c_str(), &st) == 0);
   
-  ifile.read((char *)&l, sizeof(l));
+  if (old_exists)
+    logReplay(old_log);
+  logReplay(filename + ".log");
   
-  for (std::list<TwoDInterval>::const_iterator it = l.begin(); it != l.end(); it++) {
-    insertInterval(it->GetId(), it->GetLowPoint(), it->GetHighPoint(), it->GetTimeStamp());
-  }
-    //std::string id, minKey, maxKey;
-    //uint64_t timestamp;
-    /*TwoDInterval i;
+  if (old_exists)
+    sync();
+}
 
-    //while (ifile>>id and ifile>>minKey and ifile>>maxKey and ifile>>timestamp) {
-      //insertInterval(id, minKey, maxKey, timestamp);
-    while (true) {
-      try {
-        ifile.read((char *)&i, sizeof(i));
-        insertInterval(i.GetId(), i.GetLowPoint(), i.GetHighPoint(), i.GetTimeStamp());
-      }
-      catch (...) {
-        break;
-      }
-    }*/
+publish();
+};
+
+
+//
+template <typename Key, typename Compare>
+TwoDITwTopKT<Key, Compare>::~TwoDITwTopKT() {
+
+sync();
+logClose();
+syncReclaim();
+
+// nothing reads the store any more, so what its users retired can go now
+for (typename std::deque<std::pair<uint64_t, std::function<void()> > >::iterator it = retired_releases.begin(); it != retired_releases.end(); it++) {
+  it->second();
+}
+
+std::vector<const TwoDInterval*> intervals;
+storage.values(intervals);
+
+for (typename std::vector<const TwoDInterval*>::iterator it = intervals.begin(); it != intervals.end(); it++) {
+  interval_pool.destroy(*it);
+}
+
+// nodes own nothing, so the whole tree goes with its slabs
+node_pool.release();
+
+// threads that read this store must not hand back its records once they are gone
+storeUnregister(store_id);
+
+for (TwoDITReader *x = readers.load(); x != nullptr; ) {
+  TwoDITReader *next = x->next;
+  delete x;
+  x = next;
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::insertInterval(const TwoDITId &id, const Key &minKey, const Key &maxKey, const uint64_t &maxTimestamp) {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+try {
+  if (id.empty())
+    throw std::runtime_error("Empty interval ID");
+  
+  if (image.isOpen())
+    throw std::runtime_error("Interval store is a read-only image");
+  
+  // the record goes first, so a write readers can see is one replay restores
+  if (log_mode) {
+    ZenDurability::LogRecord record;
+    record.set_type(ZenDurability::LogRecord::INSERT);
+    setRecordId(record.mutable_interval(), id);
+    std::string buf;
+    record.mutable_interval()->set_low(KeyTraits::encode(minKey, buf));
+    record.mutable_interval()->set_high(KeyTraits::encode(maxKey, buf));
+    record.mutable_interval()->set_timestamp(maxTimestamp);
     
-    ifile.close();
+    if (!logAppend(record.SerializeAsString()))
+      throw std::runtime_error("Interval not logged");
   }
+  
+  applyInsert(id, minKey, maxKey, maxTimestamp);
+  publish();
+  syncCheck(1);
+}
+catch(std::exception &e) {
+  std::cerr<<std::endl<<"Insert failure: "<<e.what()<<std::endl;
 }
 };
 
 
-//
-TwoDITwTopK::~TwoDITwTopK() {
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::insertInterval(const std::string &id, const Key &minKey, const Key &maxKey, const uint64_t &maxTimestamp) {
+
+TwoDITId x;
+
+if (!TwoDITId::parse(x, id, id_delim)) {
+  std::cerr<<std::endl<<"Insert failure: Malformed interval ID \""<<id<<"\""<<std::endl;
+  return;
+}
+
+insertInterval(x, minKey, maxKey, maxTimestamp);
+};
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::deleteInterval(const TwoDITId &id) {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+if (image.isOpen()) {
+  std::cerr<<std::endl<<"Delete failure: Interval store is a read-only image"<<std::endl;
+  return;
+}
+
+if (storage.find(id) == nullptr)
+  return;
+
+if (log_mode) {
+  ZenDurability::LogRecord record;
+  record.set_type(ZenDurability::LogRecord::DELETE);
+  setRecordId(&record, id);
+  
+  if (!logAppend(record.SerializeAsString())) {
+    std::cerr<<std::endl<<"Delete failure: Interval not logged"<<std::endl;
+    return;
+  }
+}
+
+applyDelete(id);
+publish();
+syncCheck(1);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::deleteInterval(const std::string &id) {
+
+TwoDITId x;
+
+if (TwoDITId::parse(x, id, id_delim))
+  deleteInterval(x);
+};
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::applyInsert(const TwoDITId &id, const Key &minKey, const Key &maxKey, const uint64_t &maxTimestamp) {
+
+if (id.empty())
+  throw std::runtime_error("Empty interval ID");
+
+if (image.isOpen())
+  throw std::runtime_error("Interval store is a read-only image");
+
+// an existing id is being rewritten, so delete the old interval from storage
+applyDelete(id);
+fileAdd(id);
+
+TwoDInterval *interval = interval_pool.create(id, minKey, maxKey, maxTimestamp);
+storage.set(id, interval);
+
+if (engine == ENGINE_BTREE) {
+  btree.insert(interval);
+  return;
+}
+
+TwoDITNode *z = node_pool.create();
+z->interval = interval;
+treeInsert(z);
+};
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::bulkInsert(const std::vector<TwoDInterval> &intervals) {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+try {
+  if (image.isOpen())
+    throw std::runtime_error("Interval store is a read-only image");
+  
+  std::vector<const TwoDInterval*> nodes;
+  std::unordered_set<const TwoDInterval*> replaced;
+  nodes.reserve(intervals.size());
+  storage.reserve(storage.size() + intervals.size());
+  
+  for (typename std::vector<TwoDInterval>::const_iterator it = intervals.begin(); it != intervals.end(); it++) {
+    if (!it->GetId().empty())
+      nodes.push_back(bulkNode(it->GetId(), it->GetLowPoint(), it->GetHighPoint(), it->GetTimeStamp(), replaced));
+  }
+  
+  size_t inserted = nodes.size();
+  bulkBuild(nodes, replaced, false);
+  
+  // a checkpoint is far cheaper than logging a bulk load record by record, and is taken
+  // before readers see the load
+  if (log_mode)
+    sync();
+  
+  publish();
+  
+  if (!log_mode)
+    syncCheck(inserted);
+  
+  if (inserted < intervals.size())
+    throw std::runtime_error("Empty interval ID");
+}
+catch(std::exception &e) {
+  std::cerr<<std::endl<<"Insert failure: "<<e.what()<<std::endl;
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+const typename TwoDITwTopKT<Key, Compare>::TwoDInterval* TwoDITwTopKT<Key, Compare>::bulkNode(const TwoDITId &id, const Key &minKey, const Key &maxKey, const uint64_t &maxTimestamp, std::unordered_set<const TwoDInterval*> &replaced) {
+
+fileAdd(id);
+
+const TwoDInterval *z = interval_pool.create(id, minKey, maxKey, maxTimestamp);
+
+// a rewritten id leaves its old interval, in the tree or earlier in the batch, to be dropped
+const TwoDInterval *old = storage.find(id);
+if (old != nullptr)
+  replaced.insert(old);
+storage.set(id, z);
+
+return z;
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::bulkBuild(std::vector<const TwoDInterval*> &intervals, const std::unordered_set<const TwoDInterval*> &replaced, const bool &sorted) {
+
+if (!sorted)
+  parallelSort<TwoDInterval>(intervals.begin(), intervals.end(), std::thread::hardware_concurrency());
+
+// merge with the tree's intervals, which are already in order
+std::vector<const TwoDInterval*> all;
+
+if (root != &nil or btree.root() != nullptr) {
+  std::vector<const TwoDInterval*> existing;
+  indexDrain(existing);
+  
+  all.reserve(existing.size() + intervals.size());
+  std::merge(existing.begin(), existing.end(), intervals.begin(), intervals.end(), std::back_inserter(all), lowerInterval<TwoDInterval>);
+}
+else
+  all.swap(intervals);
+
+if (!replaced.empty()) {
+  all.erase(std::remove_if(all.begin(), all.end(), [&replaced](const TwoDInterval *x) {
+    return replaced.find(x) != replaced.end();
+  }), all.end());
+  
+  for (typename std::unordered_set<const TwoDInterval*>::const_iterator it = replaced.begin(); it != replaced.end(); it++) {
+    intervalRetire(*it);
+  }
+}
+
+indexBuild(all);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::indexDrain(std::vector<const TwoDInterval*> &intervals) {
+
+// the B+-tree retires its old nodes when it is built again
+if (engine == ENGINE_BTREE) {
+  btree.inOrder(btree.root(), intervals);
+  return;
+}
+
+// the old nodes may still be read by a snapshot, so each is retired rather than reused, in
+// the same in-order pass that lists its interval
+std::vector<TwoDITNode*> stack;
+TwoDITNode *x = root;
+
+while (x != &nil or !stack.empty()) {
+  while (x != &nil) {
+    stack.push_back(x);
+    x = x->left;
+  }
+  
+  x = stack.back();
+  stack.pop_back();
+  intervals.push_back(x->interval);
+  
+  TwoDITNode *right = x->right;
+  treeRetire(x);
+  x = right;
+}
+
+root = &nil;
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::indexBuild(const std::vector<const TwoDInterval*> &intervals) {
+
+if (engine == ENGINE_BTREE) {
+  btree.build(intervals);
+  return;
+}
+
+// all levels but the last are full, so colouring that level red balances black heights
+int red_depth = 0;
+while (((size_t)2 << red_depth) <= intervals.size() + 1)
+  red_depth++;
+
+root = treeBuild(intervals, 0, intervals.size(), 0, red_depth);
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TwoDITwTopKT<Key, Compare>::applyDelete(const TwoDITId &id) {
+
+const TwoDInterval *interval = storage.erase(id);
+
+if (interval == nullptr)
+  return false;
+
+fileRemove(id);
+
+if (engine == ENGINE_BTREE)
+  btree.erase(interval);
+else
+  treeDelete(interval);
+intervalRetire(interval);
+
+return true;
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::fileAdd(const TwoDITId &id) {
+
+std::vector<uint64_t> &blocks = files[id.file];
+
+if (blocks.empty() or blocks.back() < id.block) {
+  blocks.push_back(id.block);
+  return;
+}
+
+std::vector<uint64_t>::iterator it = std::lower_bound(blocks.begin(), blocks.end(), id.block);
+
+if (*it != id.block)
+  blocks.insert(it, id.block);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::fileRemove(const TwoDITId &id) {
+
+std::unordered_map<uint64_t, std::vector<uint64_t> >::iterator f = files.find(id.file);
+
+if (f == files.end())
+  return;
+
+std::vector<uint64_t>::iterator it = std::lower_bound(f->second.begin(), f->second.end(), id.block);
+
+if (it != f->second.end() and *it == id.block)
+  f->second.erase(it);
+
+if (f->second.empty())
+  files.erase(f);
+};
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::deleteAllIntervals(const uint64_t &file) {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+if (image.isOpen()) {
+  std::cerr<<std::endl<<"Delete failure: Interval store is a read-only image"<<std::endl;
+  return;
+}
+
+if (files.find(file) == files.end())
+  return;
+
+// one record covers the whole file, replay re-expands it
+if (log_mode) {
+  ZenDurability::LogRecord record;
+  record.set_type(ZenDurability::LogRecord::DELETE_PREFIX);
+  setRecordId(&record, TwoDITId(file));
+  
+  if (!logAppend(record.SerializeAsString())) {
+    std::cerr<<std::endl<<"Delete failure: File "<<file<<" not logged"<<std::endl;
+    return;
+  }
+}
+
+uint32_t deleted = applyDeleteAll(file);
+publish();
+syncCheck(deleted);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::deleteAllIntervals(const std::string &id_prefix) {
+
+TwoDITId x;
+
+if (TwoDITId::parse(x, id_prefix, id_delim) and !x.hasBlock())
+  deleteAllIntervals(x.file);
+};
+
+//
+template <typename Key, typename Compare>
+uint32_t TwoDITwTopKT<Key, Compare>::applyDeleteAll(const uint64_t &file) {
+
+std::unordered_map<uint64_t, std::vector<uint64_t> >::iterator f = files.find(file);
+
+if (f == files.end())
+  return 0;
+
+// the block list goes whole, so no delete searches it again
+std::vector<const TwoDInterval*> dropped;
+dropped.reserve(f->second.size());
+
+for (std::vector<uint64_t>::iterator it = f->second.begin(); it != f->second.end(); it++) {
+  const TwoDInterval *interval = storage.erase(TwoDITId(file, *it));
+  
+  if (interval != nullptr)
+    dropped.push_back(interval);
+}
+
+files.erase(f);
+
+// in tree order, so one pass over the tree's own order sets them apart, and so each delete
+// descends a path the one before it has just copied and cached
+std::sort(dropped.begin(), dropped.end(), lowerInterval<TwoDInterval>);
+
+// a file holding a large share of the store is dropped by rebuilding the tree without it
+if (dropped.size() * kRebuildShare > storage.size() + dropped.size()) {
+  std::vector<const TwoDInterval*> existing, kept;
+  indexDrain(existing);
+  
+  kept.reserve(existing.size() - dropped.size());
+  std::set_difference(existing.begin(), existing.end(), dropped.begin(), dropped.end(), std::back_inserter(kept), lowerInterval<TwoDInterval>);
+  indexBuild(kept);
+}
+else
+  for (typename std::vector<const TwoDInterval*>::iterator it = dropped.begin(); it != dropped.end(); it++) {
+    if (engine == ENGINE_BTREE)
+      btree.erase(*it);
+    else
+      treeDelete(*it);
+  }
+
+for (typename std::vector<const TwoDInterval*>::iterator it = dropped.begin(); it != dropped.end(); it++) {
+  intervalRetire(*it);
+}
+
+return dropped.size();
+};
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::getInterval(TwoDInterval &ret_interval, const TwoDITId &id) const {
+
+if (image.isOpen()) {
+  uint32_t x;
+  std::string bytes;
+  idBytes(bytes, id);
+  
+  if (image.find(x, bytes))
+    imageGetInterval(ret_interval, x);
+  else
+    ret_interval = TwoDInterval();
+  
+  return;
+}
+
+// the id table is read as the writer changes it; the interval found stays allocated until
+// the read ends
+ReadScope scope(*this);
+const TwoDInterval *interval = storage.find(id);
+
+if (interval != nullptr)
+  ret_interval = *interval;
+else
+  ret_interval = TwoDInterval();
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::applyBatch(const WriteBatch &batch) {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+try {
+  if (image.isOpen())
+    throw std::runtime_error("Interval store is a read-only image");
+  
+  if (batch.size() == 0)
+    return;
+  
+  for (typename std::vector<typename WriteBatch::Op>::const_iterator it = batch.operations().begin(); it != batch.operations().end(); it++) {
+    if (it->id.empty())
+      throw std::runtime_error("Empty interval ID");
+  }
+  
+  // one record, logged before any of it is seen, so replay after a crash applies the whole
+  // batch or none of it
+  if (log_mode) {
+    ZenDurability::LogRecord record;
+    record.set_type(ZenDurability::LogRecord::BATCH);
+    
+    for (typename std::vector<typename WriteBatch::Op>::const_iterator it = batch.operations().begin(); it != batch.operations().end(); it++) {
+      setRecordOp<Key>(record.add_batch(), *it);
+    }
+    
+    std::string payload = record.SerializeAsString();
+    
+    // replay refuses records this large, a checkpoint of the new tree covers the batch instead
+    if (payload.size() > kLogMaxRecordSize) {
+      applyWrites(batch.operations());
+      sync();
+      publish();
+      return;
+    }
+    
+    if (!logAppend(payload))
+      throw std::runtime_error("Batch not logged");
+  }
+  
+  applyWrites(batch.operations());
+  publish();
+  syncCheck(batch.size());
+}
+catch(std::exception &e) {
+  std::cerr<<std::endl<<"Batch failure: "<<e.what()<<std::endl;
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::applyWrites(const std::vector<typename WriteBatch::Op> &ops) {
+
+typedef typename std::vector<typename WriteBatch::Op>::const_iterator OpIterator;
+size_t touched = 0;
+
+// checked up front, so a bad write leaves the whole batch unapplied
+for (OpIterator it = ops.begin(); it != ops.end(); it++) {
+  if (it->id.empty())
+    throw std::runtime_error("Empty interval ID");
+  
+  if (it->type == WriteBatch::DELETE_FILE) {
+    std::unordered_map<uint64_t, std::vector<uint64_t> >::const_iterator f = files.find(it->id.file);
+    touched += (f == files.end()) ? 0 : f->second.size();
+  }
+  else
+    touched++;
+}
+
+// a few writes go to the tree one by one, and copy each node of a snapshot at most once
+if (touched * kRebuildShare <= storage.size()) {
+  for (OpIterator it = ops.begin(); it != ops.end(); it++) {
+    switch (it->type) {
+      case WriteBatch::INSERT:
+        applyInsert(it->id, it->low, it->high, it->timestamp);
+        break;
+      case WriteBatch::DELETE:
+        applyDelete(it->id);
+        break;
+      case WriteBatch::DELETE_FILE:
+        applyDeleteAll(it->id.file);
+        break;
+    }
+  }
+  
+  return;
+}
+
+// many only change the id table, then one rebuild leaves out what they replaced or deleted
+std::vector<const TwoDInterval*> nodes;
+std::unordered_set<const TwoDInterval*> replaced;
+std::vector<TwoDITId> deleted;
+
+for (OpIterator it = ops.begin(); it != ops.end(); it++) {
+  deleted.clear();
+  
+  switch (it->type) {
+    case WriteBatch::INSERT:
+      nodes.push_back(bulkNode(it->id, it->low, it->high, it->timestamp, replaced));
+      break;
+    case WriteBatch::DELETE:
+      deleted.push_back(it->id);
+      break;
+    case WriteBatch::DELETE_FILE: {
+      std::unordered_map<uint64_t, std::vector<uint64_t> >::iterator f = files.find(it->id.file);
+      
+      if (f != files.end())
+        for (std::vector<uint64_t>::iterator b = f->second.begin(); b != f->second.end(); b++) {
+          deleted.push_back(TwoDITId(it->id.file, *b));
+        }
+      break;
+    }
+  }
+  
+  for (std::vector<TwoDITId>::iterator id = deleted.begin(); id != deleted.end(); id++) {
+    const TwoDInterval *interval = storage.erase(*id);
+    
+    if (interval != nullptr) {
+      fileRemove(*id);
+      replaced.insert(interval);
+    }
+  }
+}
+
+bulkBuild(nodes, replaced, false);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::getSize(uint64_t &size) const {
+
+// the published count, so a long write does not hold the caller up
+ReadScope scope(*this);
+size = image.isOpen() ? image.size() : scope.snapshot->size;
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TwoDITwTopKT<Key, Compare>::getKeyRange(Key &minKey, Key &maxKey) const {
+
+ReadScope scope(*this);
+const Snapshot *snapshot = scope.snapshot;
+
+// every root keeps its tree's leftmost low point and largest high point
+if (image.isOpen()) {
+  if (image.size() == 0)
+    return false;
+  
+  TwoDInterval low, high;
+  imageGetInterval(low, image.node(image.root()).min_low);
+  imageGetInterval(high, image.node(image.root()).max_high);
+  minKey = low.GetLowPoint();
+  maxKey = high.GetHighPoint();
+}
+else if (engine == ENGINE_BTREE) {
+  const BTreeNode *x = snapshot->btree_root;
+  
+  if (x == nullptr)
+    return false;
+  
+  typename KeyTraits::Ref high = x->high[0];
+  
+  for (uint32_t i = 1; i < x->count; i++) {
+    high = maxHigh2<TwoDInterval, KeyTraits>(high, x->high[i]);
+  }
+  
+  minKey = KeyTraits::deref(x->low[0]);
+  maxKey = KeyTraits::deref(high);
+}
+else {
+  if (snapshot->root == &nil)
+    return false;
+  
+  minKey = KeyTraits::deref(snapshot->root->min_low);
+  maxKey = KeyTraits::deref(snapshot->root->max_high);
+}
+
+return true;
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::getInterval(TwoDInterval &ret_interval, const std::string &id) const {
+
+TwoDITId x;
+
+if (TwoDITId::parse(x, id, id_delim))
+  getInterval(ret_interval, x);
+else
+  ret_interval = TwoDInterval();
+};
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey) const {
+
+visitOverlaps(minKey, maxKey, [&ret_value](const TwoDInterval &interval) {
+  ret_value.push_back(interval);
+  return true;
+});
+
+std::sort(ret_value.begin(), ret_value.end(), std::greater<TwoDInterval>());
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::visitOverlaps(const Key &minKey, const Key &maxKey, const Visitor &visit) const {
+
+ReadScope scope(*this);
+
+// one in-order pass that skips every sub-tree ending before minKey or starting after
+// maxKey, so the cost is O(log n + m) for m overlaps
+if (image.isOpen()) {
+  std::string min_buf, max_buf;
+  imageVisit(image.root(), KeyTraits::encode(minKey, min_buf), KeyTraits::encode(maxKey, max_buf), visit);
+}
+else if (engine == ENGINE_BTREE) {
+  TwoDInterval test(TwoDITId(), minKey, maxKey, 0LL);
+  
+  btree.search(scope.snapshot->btree_root, test, [&visit](const TwoDInterval *interval) {
+    return visit(*interval);
+  });
+}
+else
+  treeVisit(scope.snapshot->root, KeyTraits::ref(minKey), KeyTraits::ref(maxKey), visit);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::visitOverlaps(const std::vector<std::pair<Key, Key> > &ranges, const BatchVisitor &visit, const unsigned &threads) const {
+
+typedef typename KeyTraits::Ref Ref;
+ReadScope scope(*this);
+const Snapshot *snapshot = scope.snapshot;
+std::vector<BatchRange<Ref> > tree_ranges(ranges.size());
+std::vector<BatchRange<std::string> > image_ranges(image.isOpen() ? ranges.size() : 0);
+std::string buf;
+
+// sort by low, then carry the largest high forward, so a sub-tree only walks the ranges
+// that start before its max_high and reach past its lowest low point
+if (image.isOpen()) {
+  for (size_t i = 0; i < ranges.size(); i++) {
+    image_ranges[i].low = KeyTraits::encode(ranges[i].first, buf);
+    image_ranges[i].high = KeyTraits::encode(ranges[i].second, buf);
+    image_ranges[i].index = i;
+  }
+  
+  std::sort(image_ranges.begin(), image_ranges.end(), [](const BatchRange<std::string> &a, const BatchRange<std::string> &b) {
+    return a.low < b.low;
+  });
+  
+  for (size_t i = 0; i < image_ranges.size(); i++) {
+    image_ranges[i].reach = (i > 0 and image_ranges[i].high < image_ranges[i - 1].reach) ? image_ranges[i - 1].reach : image_ranges[i].high;
+  }
+}
+else {
+  for (size_t i = 0; i < ranges.size(); i++) {
+    tree_ranges[i].low = KeyTraits::ref(ranges[i].first);
+    tree_ranges[i].high = KeyTraits::ref(ranges[i].second);
+    tree_ranges[i].index = i;
+  }
+  
+  std::sort(tree_ranges.begin(), tree_ranges.end(), [](const BatchRange<Ref> &a, const BatchRange<Ref> &b) {
+    return TwoDInterval::lowerRef(a.low, b.low);
+  });
+  
+  for (size_t i = 0; i < tree_ranges.size(); i++) {
+    tree_ranges[i].reach = (i > 0) ? maxHigh2<TwoDInterval, KeyTraits>(tree_ranges[i - 1].reach, tree_ranges[i].high) : tree_ranges[i].high;
+  }
+}
+
+std::atomic<bool> stopped(false);
+BatchVisitor shared = [&visit, &stopped](const TwoDInterval &interval, const size_t &range) {
+  if (stopped or !visit(interval, range)) {
+    stopped = true;
+    return false;
+  }
+  
+  return true;
+};
+
+// each slice of the sorted ranges is one walk; false from visit stops them all
+unsigned slices = (threads < 2 or ranges.size() < 2) ? 1 : (unsigned)std::min<size_t>(threads, ranges.size());
+std::function<void(size_t, size_t)> walk = [&](size_t begin, size_t end) {
+  const BatchVisitor &v = (slices > 1) ? shared : visit;
+  
+  if (begin == end)
+    return;
+  
+  if (image.isOpen())
+    imageVisitBatch(image.root(), image_ranges, begin, end, v);
+  else if (engine == ENGINE_BTREE) {
+    if (snapshot->btree_root != nullptr)
+      btreeVisitBatch(snapshot->btree_root, tree_ranges, begin, end, v);
+  }
+  else
+    treeVisitBatch(snapshot->root, tree_ranges, begin, end, v);
+};
+std::vector<std::thread> workers;
+
+for (unsigned t = 1; t < slices; t++) {
+  workers.push_back(std::thread(walk, ranges.size() * t / slices, ranges.size() * (t + 1) / slices));
+}
+
+walk(0, ranges.size() / slices);
+
+for (typename std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); it++) {
+  it->join();
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::topK(std::vector<std::vector<TwoDInterval> > &ret_values, const std::vector<std::pair<Key, Key> > &ranges) const {
+
+ret_values.resize(ranges.size());
+
+visitOverlaps(ranges, [&ret_values](const TwoDInterval &interval, const size_t &range) {
+  ret_values[range].push_back(interval);
+  return true;
+});
+
+for (typename std::vector<std::vector<TwoDInterval> >::iterator it = ret_values.begin(); it != ret_values.end(); it++) {
+  std::sort(it->begin(), it->end(), std::greater<TwoDInterval>());
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k) const {
+
+// best-first on max_timestamp, so only the branches that can still hold one of the k
+// newest overlaps are opened; results come out newest first
+topK(ret_value, minKey, maxKey, k, 0, UINT64_MAX);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
+
+if (k == 0 or minTimestamp > maxTimestamp)
+  return;
+
+ReadScope scope(*this);
+
+// a sub-tree is opened only if its [min_timestamp, max_timestamp] meets the window, and is
+// ranked by the newest timestamp it may hold inside it
+if (image.isOpen()) {
+  std::string min_buf, max_buf;
+  imageTopK(ret_value, KeyTraits::encode(minKey, min_buf), KeyTraits::encode(maxKey, max_buf), k, minTimestamp, maxTimestamp);
+  return;
+}
+
+std::vector<const TwoDInterval*> found;
+indexTopK(found, scope.snapshot, minKey, maxKey, k, minTimestamp, maxTimestamp);
+ret_value.reserve(ret_value.size() + found.size());
+
+for (typename std::vector<const TwoDInterval*>::iterator it = found.begin(); it != found.end(); it++) {
+  ret_value.push_back(**it);
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::topK(std::vector<const TwoDInterval*> &ret_value, const ReadGuard &guard, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
+
+if (&guard.store != this) {
+  std::cerr<<std::endl<<"Query failure: the read guard is on another store"<<std::endl;
+  return;
+}
+
+if (k == 0 or minTimestamp > maxTimestamp)
+  return;
+
+// inside the guard's read, so what this finds stays allocated until the guard goes
+ReadScope scope(*this);
+
+if (image.isOpen()) {
+  std::vector<TwoDInterval> found;
+  std::string min_buf, max_buf;
+  imageTopK(found, KeyTraits::encode(minKey, min_buf), KeyTraits::encode(maxKey, max_buf), k, minTimestamp, maxTimestamp);
+  
+  for (typename std::vector<TwoDInterval>::iterator it = found.begin(); it != found.end(); it++) {
+    guard.decoded.push_back(std::move(*it));
+    ret_value.push_back(&guard.decoded.back());
+  }
+  return;
+}
+
+indexTopK(ret_value, scope.snapshot, minKey, maxKey, k, minTimestamp, maxTimestamp);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::indexTopK(std::vector<const TwoDInterval*> &ret_value, const Snapshot* snapshot, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
+
+if (engine == ENGINE_BTREE)
+  btreeTopK(ret_value, snapshot->btree_root, minKey, maxKey, k, minTimestamp, maxTimestamp);
+else
+  treeTopK(ret_value, snapshot->root, minKey, maxKey, k, minTimestamp, maxTimestamp);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey) const {
+
+groupByFile(ret_value, [this, &minKey, &maxKey](const Visitor &add) {
+  visitOverlaps(minKey, maxKey, add);
+});
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k) const {
+
+topKByFile(ret_value, minKey, maxKey, k, 0, UINT64_MAX);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
+
+groupByFile(ret_value, [&](const Visitor &add) {
+  std::vector<TwoDInterval> newest;
+  topK(newest, minKey, maxKey, k, minTimestamp, maxTimestamp);
+  
+  for (typename std::vector<TwoDInterval>::iterator it = newest.begin(); it != newest.end(); it++) {
+    add(*it);
+  }
+});
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::groupByFile(std::vector<TwoDITFileHits> &ret_value, const std::function<void(const Visitor&)> &fill) {
+
+std::vector<TwoDITFileHits> files;
+std::unordered_map<uint64_t, size_t> position;
+
+fill([&files, &position](const TwoDInterval &interval) {
+  const TwoDITId &id = interval.GetId();
+  std::pair<std::unordered_map<uint64_t, size_t>::iterator, bool> found = position.insert(std::make_pair(id.file, files.size()));
+  
+  if (found.second) {
+    TwoDITFileHits hits = {id.file, interval.GetTimeStamp(), std::vector<uint64_t>()};
+    files.push_back(hits);
+  }
+  
+  TwoDITFileHits &hits = files[found.first->second];
+  hits.timestamp = std::max(hits.timestamp, interval.GetTimeStamp());
+  
+  if (id.hasBlock())
+    hits.blocks.push_back(id.block);
+  return true;
+});
+
+for (std::vector<TwoDITFileHits>::iterator it = files.begin(); it != files.end(); it++) {
+  std::sort(it->blocks.begin(), it->blocks.end());
+}
+
+// newest first, and by file number among equals so the order does not depend on the walk
+std::sort(files.begin(), files.end(), [](const TwoDITFileHits &a, const TwoDITFileHits &b) {
+  return a.timestamp > b.timestamp or (a.timestamp == b.timestamp and a.file < b.file);
+});
+
+ret_value.insert(ret_value.end(), std::make_move_iterator(files.begin()), std::make_move_iterator(files.end()));
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::sync() const {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+// an image is its own durable state, and a store without a sync file keeps none
+if (image.isOpen() or sync_file.empty())
+  return;
+
+waitForSync();
+
+if (!syncWrite(root, btree.root(), sync_file))
+  return;
+
+// the snapshot now covers every logged operation; replaying a log left behind by a crash
+// right here is harmless, as each record only restates the final state of its ids
+log_unsynced = 0;
+
+if (log_fd >= 0) {
+  if (ftruncate(log_fd, 0) != 0)
+    std::cerr<<std::endl<<"Sync failure: cannot truncate "<<sync_file<<".log"<<std::endl;
+  else
+    log_size = 0;
+}
+else
+  std::remove((sync_file + ".log").c_str());
+
+std::remove((sync_file + ".log.old").c_str());
+
+sync_counter = 0;
+synced_sequence = write_sequence;
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TwoDITwTopKT<Key, Compare>::syncWrite(const TwoDITNode* x, const BTreeNode* b, const std::string &filename) const {
+
+// stream the tree in-order into a temporary file and rename it over the sync file,
+// so a crash mid-sync never leaves a truncated snapshot behind
+std::string tmp_file = filename + ".tmp";
+int fd = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+if (fd < 0) {
+  std::cerr<<std::endl<<"Sync failure: cannot open "<<tmp_file<<std::endl;
+  return false;
+}
+
+std::vector<const TwoDInterval*> intervals;
+indexInOrder(x, b, intervals);
+
+bool ok;
+google::protobuf::io::FileOutputStream raw(fd);
+{
+  google::protobuf::io::CodedOutputStream coded(&raw);
+  ZenDurability::Interval record;
+  std::string buf;
+  
+  for (typename std::vector<const TwoDInterval*>::const_iterator it = intervals.begin(); it != intervals.end(); it++) {
+    setRecordId(&record, (*it)->GetId());
+    record.set_low(KeyTraits::encode((*it)->GetLowPoint(), buf));
+    record.set_high(KeyTraits::encode((*it)->GetHighPoint(), buf));
+    record.set_timestamp((*it)->GetTimeStamp());
+    
+    coded.WriteTag(kIntervalTag);
+    coded.WriteVarint32(record.ByteSizeLong());
+    record.SerializeWithCachedSizes(&coded);
+  }
+  
+  ok = !coded.HadError();
+}
+
+ok = raw.Flush() and ok;
+ok = (fsync(fd) == 0) and ok;
+ok = raw.Close() and ok;
+
+if (!ok or std::rename(tmp_file.c_str(), filename.c_str()) != 0) {
+  std::cerr<<std::endl<<"Sync failure: cannot write "<<filename<<std::endl;
+  std::remove(tmp_file.c_str());
+  return false;
+}
+
+return true;
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::syncStart() {
+
+// one snapshot at a time, a crossing while it runs is picked up by the next check
+if (sync_running)
+  return;
+
+syncReclaim();
+
+// later records go to a fresh log, the rotated one is only needed until the snapshot lands;
+// if an earlier rotated log is still there, its sync failed and both stay until one succeeds
+if (log_fd >= 0) {
+  std::string log_file = sync_file + ".log", old_log = sync_file + ".log.old";
+  struct stat st;
+  
+  if (stat(old_log.c_str(), &st) != 0) {
+    logClose();
+    if (std::rename(log_file.c_str(), old_log.c_str()) != 0)
+      std::cerr<<std::endl<<"Sync failure: cannot rotate "<<log_file<<std::endl;
+    logOpen();
+  }
+  else
+    flushLog();
+}
+
+// read the current tree, just published, as any reader would
+const Snapshot *snapshot = readBegin(sync_reader);
+sync_counter = 0;
+sync_running = true;
+
+sync_thread = std::thread(&TwoDITwTopKT::syncBackground, this, snapshot->root, snapshot->btree_root, sync_file, write_sequence);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::syncBackground(const TwoDITNode* x, const BTreeNode* b, const std::string filename, const uint64_t sequence) {
+
+if (syncWrite(x, b, filename)) {
+  std::remove((filename + ".log.old").c_str());
+  synced_sequence = sequence;
+}
+
+sync_running = false;
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::syncReclaim() {
+
+// a finished sync lets go of its snapshot
+if (!sync_running) {
+  if (sync_thread.joinable())
+    sync_thread.join();
+  
+  readEnd(sync_reader);
+}
+
+reclaim();
+};
+
+
+//
+template <typename Key, typename Compare>
+TwoDITReader* TwoDITwTopKT<Key, Compare>::readerClaim() const {
+
+bool expected = false;
+
+for (TwoDITReader *x = readers.load(); x != nullptr; x = x->next) {
+  if (!x->claimed.load(std::memory_order_relaxed) and x->claimed.compare_exchange_strong(expected, true))
+    return x;
+  expected = false;
+}
+
+TwoDITReader *reader = new TwoDITReader();
+reader->claimed = true;
+reader->version = 0;
+reader->next = readers.load();
+
+while (!readers.compare_exchange_weak(reader->next, reader));
+
+return reader;
+};
+
+
+//
+template <typename Key, typename Compare>
+const typename TwoDITwTopKT<Key, Compare>::Snapshot* TwoDITwTopKT<Key, Compare>::readBegin(TwoDITReader* &reader) const {
+
+// a record of its own, for a read that may end on another thread
+reader = readerClaim();
+
+// the version is announced before the snapshot is read, and publish() stores the snapshot
+// before its version, so the snapshot is never older than the announcement
+reader->version = published_version.load();
+return published.load();
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::readEnd(TwoDITReader* &reader) const {
+
+if (reader == nullptr)
+  return;
+
+reader->version = 0;
+reader->claimed.store(false, std::memory_order_release);
+reader = nullptr;
+};
+
+
+//
+template <typename Key, typename Compare>
+const typename TwoDITwTopKT<Key, Compare>::Snapshot* TwoDITwTopKT<Key, Compare>::readEnter() const {
+
+TwoDITThreadReads::Entry *entry = thread_reads.find(store_id);
+
+// only a thread's first query on the store registers a record
+if (entry == nullptr) {
+  TwoDITThreadReads::Entry e = {store_id, readerClaim(), 0};
+  thread_reads.add(e);
+  entry = &thread_reads.entries.back();
+}
+
+// one store and one load, never a retry: an outer query's older announcement still covers
+// whatever a nested one finds published, see readBegin()
+if (entry->depth++ == 0)
+  entry->reader->version = published_version.load();
+
+return published.load();
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::readExit() const {
+
+TwoDITThreadReads::Entry *entry = thread_reads.find(store_id);
+
+if (--entry->depth == 0)
+  entry->reader->version.store(0, std::memory_order_release);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::publish() {
+
+Snapshot *snapshot = snapshot_pool.create();
+
+// freeze the current version; the next write copies any node it touches
+frozen_version = write_version++;
+snapshot->root = root;
+snapshot->btree_root = btree.freeze(frozen_version);
+snapshot->version = frozen_version;
+snapshot->size = storage.size();
+storage.freeze(frozen_version);
+
+const Snapshot *old = published.load();
+published = snapshot;
+published_version = frozen_version;
+
+// a reader that announced an older version may still hold the old snapshot
+if (old != nullptr)
+  retired_snapshots.push_back(std::make_pair(frozen_version, old));
+
+reclaim();
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::reclaim() {
+
+uint64_t oldest = published_version;
+
+// a reader reads a snapshot at least as new as the version it announced
+for (TwoDITReader *x = readers.load(); x != nullptr; x = x->next) {
+  uint64_t version = x->version;
+  
+  if (version != 0 and version < oldest)
+    oldest = version;
+}
+
+// what was dropped in version v is only reachable from snapshots frozen before v
+while (!retired_nodes.empty() and retired_nodes.front().first <= oldest) {
+  node_pool.destroy(retired_nodes.front().second);
+  retired_nodes.pop_front();
+}
+
+while (!retired_intervals.empty() and retired_intervals.front().first <= oldest) {
+  interval_pool.destroy(retired_intervals.front().second);
+  retired_intervals.pop_front();
+}
+
+while (!retired_snapshots.empty() and retired_snapshots.front().first <= oldest) {
+  snapshot_pool.destroy(retired_snapshots.front().second);
+  retired_snapshots.pop_front();
+}
+
+while (!retired_releases.empty() and retired_releases.front().first <= oldest) {
+  retired_releases.front().second();
+  retired_releases.pop_front();
+}
+
+btree.reclaim(oldest);
+storage.reclaim(oldest);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::retire(const std::function<void()> &release) {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+// readers have announced at most the published version, so the next one is past them all
+retired_releases.push_back(std::make_pair(write_version, release));
+reclaim();
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::waitForSync() const {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+if (sync_thread.joinable())
+  sync_thread.join();
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::getSyncPoint(uint64_t &synced, uint64_t &current) const {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+synced = synced_sequence;
+current = write_sequence;
+};
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::syncCheck(const uint32_t &ops) {
+
+sync_counter += ops;
+write_sequence += ops;
+
+syncReclaim();
+
+// in log mode the snapshot is just a checkpoint, rewritten once the log outgrows it,
+// which keeps the checkpoint cost amortized constant per operation
+if (!sync_file.empty() and sync_counter > sync_threshold and (!log_mode or sync_counter > storage.size())) {
+  if (background_sync)
+    syncStart();
+  else
+    sync();
+}
+};
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::flushLog() const {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+if (log_fd < 0)
+  return;
+
+if (log_unsynced > 0 and fdatasync(log_fd) != 0)
+  std::cerr<<std::endl<<"Log failure: cannot sync "<<sync_file<<".log"<<std::endl;
+
+log_unsynced = 0;
+log_last_fsync = std::chrono::steady_clock::now();
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TwoDITwTopKT<Key, Compare>::logAppend(const std::string &record) {
+
+char header[kLogHeaderSize];
+encodeFixed32(header, crc32c(record));
+encodeFixed32(header + 4, record.size());
+
+// the record reaches the OS at once, so it outlives the process; the policy only decides
+// when it is forced to disk
+log_buffer.assign(header, kLogHeaderSize);
+log_buffer.append(record);
+
+// replay stops at the first bad record, so a partly written one is cut off again
+if (log_fd < 0 or !writeAll(log_fd, log_buffer)) {
+  if (log_fd >= 0 and ftruncate(log_fd, log_size) == 0) {
+    std::cerr<<std::endl<<"Log failure: cannot write "<<sync_file<<".log"<<std::endl;
+    return false;
+  }
+  
+  // without a log that replays cleanly the store falls back to snapshots, taking one now
+  std::cerr<<std::endl<<"Log failure: "<<sync_file<<".log is unusable, log mode is off"<<std::endl;
+  logClose();
+  log_mode = false;
+  sync();
+  return false;
+}
+
+log_size += log_buffer.size();
+log_unsynced++;
+
+bool commit = false;
+
+switch (fsync_policy) {
+  case FSYNC_PER_OP:
+    commit = true;
+    break;
+  case FSYNC_PER_N_OPS:
+    commit = (log_unsynced >= fsync_n);
+    break;
+  case FSYNC_PER_INTERVAL:
+    commit = (std::chrono::steady_clock::now() - log_last_fsync >= std::chrono::milliseconds(fsync_n));
+    break;
+  case FSYNC_NONE:
+    break;
+}
+
+if (commit)
+  flushLog();
+
+return true;
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::logOpen() {
+
+if (sync_file.empty()) {
+  std::cerr<<std::endl<<"Log failure: a store without a sync file keeps no log"<<std::endl;
+  return;
+}
+
+log_fd = open((sync_file + ".log").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+struct stat st;
+
+if (log_fd < 0 or fstat(log_fd, &st) != 0)
+  std::cerr<<std::endl<<"Log failure: cannot open "<<sync_file<<".log"<<std::endl;
+else
+  log_size = st.st_size;
+
+log_last_fsync = std::chrono::steady_clock::now();
+flushStart();
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::logClose() {
+
+flushStop();
+
+if (log_fd >= 0) {
+  flushLog();
+  close(log_fd);
+  log_fd = -1;
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::flushStart() {
+
+if (log_fd < 0 or fsync_policy != FSYNC_PER_INTERVAL or flush_thread.joinable())
+  return;
+
+flush_stop = false;
+flush_thread = std::thread(&TwoDITwTopKT::flushBackground, this);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::flushStop() {
+
+if (!flush_thread.joinable())
+  return;
+
+{
+  std::lock_guard<std::mutex> lock(flush_mutex);
+  flush_stop = true;
+}
+
+flush_wake.notify_one();
+flush_thread.join();
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::flushBackground() {
+
+std::unique_lock<std::mutex> lock(flush_mutex);
+
+while (!flush_stop) {
+  flush_wake.wait_for(lock, std::chrono::milliseconds(std::max<uint32_t>(fsync_n, 1)));
+  
+  if (flush_stop)
+    break;
+  
+  // a writer holding the store, perhaps to stop this thread, commits on its own next append
+  lock.unlock();
+  
+  if (write_mutex.try_lock()) {
+    if (log_unsynced > 0 and std::chrono::steady_clock::now() - log_last_fsync >= std::chrono::milliseconds(fsync_n))
+      flushLog();
+    write_mutex.unlock();
+  }
+  
+  lock.lock();
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::logReplay(const std::string &filename) {
+
+std::ifstream ifile(filename.c_str(), std::ios::binary);
+
+if (!ifile.is_open())
+  return;
+
+char header[kLogHeaderSize];
+std::string payload;
+ZenDurability::LogRecord record;
+off_t valid = 0;
+
+while (ifile.read(header, kLogHeaderSize)) {
+  
+  uint32_t crc = decodeFixed32(header), size = decodeFixed32(header + 4);
+  
+  if (size > kLogMaxRecordSize)
+    break;
+  
+  payload.resize(size);
+  
+  if (!ifile.read(&payload[0], size) or crc32c(payload) != crc or !record.ParseFromString(payload))
+    break;
+  
+  valid += kLogHeaderSize + size;
+  
+  // a batch is decoded whole before any of it is applied, as it was written
+  std::vector<typename WriteBatch::Op> ops((record.type() == ZenDurability::LogRecord::BATCH) ? record.batch_size() : 1);
+  
+  try {
+    if (record.type() == ZenDurability::LogRecord::BATCH) {
+      for (int i = 0; i < record.batch_size(); i++) {
+        getRecordOp<Key>(ops[i], record.batch(i), id_delim);
+      }
+    }
+    else
+      getRecordOp<Key>(ops[0], record, id_delim);
+    
+    applyWrites(ops);
+  }
+  catch(std::exception &e) {
+    std::cerr<<std::endl<<"Load failure: "<<e.what()<<std::endl;
+  }
+  
+  sync_counter += ops.size();
+}
+
+ifile.close();
+
+// drop a record torn by a crash so later appends are not hidden behind it
+struct stat st;
+if (stat(filename.c_str(), &st) == 0 and st.st_size > valid) {
+  std::cerr<<std::endl<<"Load failure: dropping corrupt tail of "<<filename<<std::endl;
+  if (truncate(filename.c_str(), valid) != 0)
+    std::cerr<<std::endl<<"Load failure: cannot truncate "<<filename<<std::endl;
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::syncLoad(const std::string &filename) {
+
+int fd = open(filename.c_str(), O_RDONLY);
+
+if (fd < 0)
+  return;
+
+google::protobuf::io::FileInputStream raw(fd);
+raw.SetCloseOnDelete(true);
+ZenDurability::Interval record;
+uint32_t size;
+std::vector<const TwoDInterval*> intervals;
+std::unordered_set<const TwoDInterval*> replaced;
+bool sorted = true;
+
+while (true) {
+  // a fresh CodedInputStream per record keeps its byte limit from capping large files
+  google::protobuf::io::CodedInputStream coded(&raw);
+  uint32_t tag = coded.ReadTag();
+  
+  if (tag == 0)
+    break;
+  
+  if (tag != kIntervalTag or !coded.ReadVarint32(&size)) {
+    std::cerr<<std::endl<<"Load failure: corrupt record in "<<filename<<std::endl;
+    break;
+  }
+  
+  google::protobuf::io::CodedInputStream::Limit limit = coded.PushLimit(size);
+  
+  if (!record.ParseFromCodedStream(&coded) or !coded.ConsumedEntireMessage()) {
+    std::cerr<<std::endl<<"Load failure: corrupt record in "<<filename<<std::endl;
+    break;
+  }
+  
+  coded.PopLimit(limit);
+  
+  TwoDITId id;
+  
+  if (!getRecordId(id, record, id_delim)) {
+    std::cerr<<std::endl<<"Load failure: Malformed interval ID \""<<record.id()<<"\""<<std::endl;
+    continue;
+  }
+  
+  try {
+    intervals.push_back(bulkNode(id, KeyTraits::decode(record.low()), KeyTraits::decode(record.high()), record.timestamp(), replaced));
+  }
+  catch(std::exception &e) {
+    std::cerr<<std::endl<<"Load failure: "<<e.what()<<std::endl;
+    continue;
+  }
+  
+  // snapshots are written in order, so only a hand-made file needs sorting
+  if (sorted and intervals.size() > 1 and !lowerInterval<TwoDInterval>(intervals[intervals.size() - 2], intervals.back()))
+    sorted = false;
+}
+
+if (!intervals.empty())
+  bulkBuild(intervals, replaced, sorted);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::setSyncFile(const std::string &filename) {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+waitForSync();
+logClose();
+sync_file = filename;
+
+// the log only makes sense on top of a snapshot under the same name
+if (log_mode) {
+  logOpen();
+  sync();
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::setLogMode(const bool &enable) {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+waitForSync();
+
+if (enable and !log_mode) {
+  log_mode = true;
+  logOpen();
+  sync();
+}
+else if (!enable and log_mode) {
+  logClose();
+  log_mode = false;
+  sync();
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::getSyncFile(std::string &filename) const { std::lock_guard<std::recursive_mutex> lock(write_mutex); filename = sync_file; };
+
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::setSyncThreshold(const uint32_t &threshold) { std::lock_guard<std::recursive_mutex> lock(write_mutex); sync_threshold = threshold; };
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::getSyncThreshold(uint32_t &threshold) const { std::lock_guard<std::recursive_mutex> lock(write_mutex); threshold = sync_threshold; };
+
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::getLogMode(bool &enable) const { std::lock_guard<std::recursive_mutex> lock(write_mutex); enable = log_mode; };
+
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::setBackgroundSync(const bool &enable) { std::lock_guard<std::recursive_mutex> lock(write_mutex); background_sync = enable; };
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::getBackgroundSync(bool &enable) const { std::lock_guard<std::recursive_mutex> lock(write_mutex); enable = background_sync; };
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::setFsyncPolicy(const TwoDITFsyncPolicy &policy, const uint32_t &n) {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+flushStop();
+flushLog();
+fsync_policy = policy;
+fsync_n = n;
+flushStart();
+};
+
+
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::getFsyncPolicy(TwoDITFsyncPolicy &policy, uint32_t &n) const { std::lock_guard<std::recursive_mutex> lock(write_mutex); policy = fsync_policy; n = fsync_n; };
+
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::setIdDelimiter(const char &delim) { id_delim = delim; };
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::getIdDelimiter(char &delim) const { delim = id_delim; };
+
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::getEngine(TwoDITEngine &engine) const { engine = this->engine; };
+
+
+//
+template <typename Key, typename Compare>
+bool TwoDITwTopKT<Key, Compare>::exportImage(const std::string &filename) const {
+
+if (image.isOpen()) {
+  std::cerr<<std::endl<<"Export failure: Interval store is already an image"<<std::endl;
+  return false;
+}
+
+// images order keys by their encoded bytes, which only matches the default comparator
+if (!std::is_same<Compare, std::less<Key> >::value) {
+  std::cerr<<std::endl<<"Export failure: images need the default key order"<<std::endl;
+  return false;
+}
+
+// a reader like any query, so writers need not wait for the export
+ReadScope scope(*this);
+std::vector<const TwoDInterval*> intervals;
+indexInOrder(scope.snapshot->root, scope.snapshot->btree_root, intervals);
+
+std::vector<TwoDITImageRecord> records(intervals.size());
+std::string buf;
+
+for (size_t i = 0; i < intervals.size(); i++) {
+  idBytes(records[i].id, intervals[i]->GetId());
+  records[i].low = KeyTraits::encode(intervals[i]->GetLowPoint(), buf);
+  records[i].high = KeyTraits::encode(intervals[i]->GetHighPoint(), buf);
+  records[i].timestamp = intervals[i]->GetTimeStamp();
+}
+
+if (!TwoDITImage::write(filename, records)) {
+  std::cerr<<std::endl<<"Export failure: cannot write "<<filename<<std::endl;
+  return false;
+}
+
+return true;
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TwoDITwTopKT<Key, Compare>::openImage(const std::string &filename) {
+
+if (!std::is_same<Compare, std::less<Key> >::value) {
+  std::cerr<<std::endl<<"Open failure: images need the default key order"<<std::endl;
+  return false;
+}
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+waitForSync();
+syncReclaim();
+
+// the tree's slabs are released below, so no iterator may still be reading them
+for (TwoDITReader *x = readers.load(); x != nullptr; x = x->next) {
+  if (x->version != 0) {
+    std::cerr<<std::endl<<"Open failure: iterators are still reading the interval tree"<<std::endl;
+    return false;
+  }
+}
+
+if (!image.open(filename)) {
+  std::cerr<<std::endl<<"Open failure: "<<filename<<" is not an interval tree image"<<std::endl;
+  return false;
+}
+
+// the image replaces the tree, there is nothing left to log or sync
+logClose();
+log_mode = false;
+
+std::vector<const TwoDInterval*> intervals;
+storage.values(intervals);
+
+for (typename std::vector<const TwoDInterval*>::iterator it = intervals.begin(); it != intervals.end(); it++) {
+  interval_pool.destroy(*it);
+}
+
+// hand the slabs back, the image needs none of them
+node_pool.release();
+interval_pool.release();
+btree.clear();
+
+root = &nil;
+storage.clear();
+files.clear();
+publish();
+
+return true;
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::storagePrint() const {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+std::vector<const TwoDInterval*> intervals;
+storage.values(intervals);
+
+for (typename std::vector<const TwoDInterval*>::const_iterator it = intervals.begin(); it != intervals.end(); it++) {
+  std::cout<<"("<<(*it)->GetId()<<","<<(*it)->GetLowPoint()<<","<<(*it)->GetHighPoint()
+        <<","<<(*it)->GetTimeStamp()<<")"<<"\n";
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treePrintLevelOrder() const {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+if (engine == ENGINE_BTREE) {
+  btree.print();
+  return;
+}
+
+int depth, level=0;
+TwoDITNode* x;
+std::deque<std::pair<TwoDITNode*, int>> nodes;
+std::stringstream line1, line2, line3, buffer;
+
+if (root != &nil) {
+  nodes.push_back(std::make_pair(root, 0));
+}
+
+while (!nodes.empty()) {
+  x = nodes.front().first;
+  depth = nodes.front().second;
+  nodes.pop_front();
+  
+  if (depth != level) {
+    std::cout<<line1.str()<<std::endl<<line2.str()<<std::endl<<line3.str()<<std::endl<<std::endl;
+    line1.str(std::string());
+    line2.str(std::string());
+    line3.str(std::string());
+    level++;
+  }
+  
+  buffer<<"("<<x->interval->GetId()<<","<<x->interval->GetLowPoint()<<","<<x->interval->GetHighPoint()
+        <<","<<x->interval->GetTimeStamp()<<")";
+  line1<<std::setw(13)<<buffer.str();
+  buffer.str(std::string());
+
+  buffer<<"("<<KeyTraits::deref(x->max_high)<<","<<x->max_timestamp<<","<<(x->is_red ? 'R' : 'B')<<")";
+  line2<<std::setw(13)<<buffer.str();
+  buffer.str(std::string());
+  
+  if (x->left != &nil) {
+    nodes.push_back(std::make_pair(x->left, depth+1));
+    buffer<<'/'<<x->left->interval->GetId();
+  }
+  buffer<<"    ";
+  
+  if (x->right != &nil) {
+    nodes.push_back(std::make_pair(x->right, depth+1));
+    buffer<<'\\'<<x->right->interval->GetId();
+  }
+  line3<<std::setw(13)<<buffer.str();
+  buffer.str(std::string());
+}
+
+std::cout<<line1.str()<<std::endl<<line2.str()<<std::endl;
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treePrintInOrder() const {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+if (engine == ENGINE_BTREE) {
+  std::vector<const TwoDInterval*> intervals;
+  btree.inOrder(btree.root(), intervals);
+  
+  for (typename std::vector<const TwoDInterval*>::const_iterator it = intervals.begin(); it != intervals.end(); it++) {
+    std::cout<<" ("<<(*it)->GetId()<<","<<(*it)->GetLowPoint()<<","<<(*it)->GetHighPoint()<<","<<(*it)->GetTimeStamp()<<")";
+  }
+}
+else
+  treePrintInOrderRecursive(root, 0);
+std::cout<<std::endl;
+};
+
+
+//
+template <typename Key, typename Compare>
+int TwoDITwTopKT<Key, Compare>::treeHeight() const {
+
+std::lock_guard<std::recursive_mutex> lock(write_mutex);
+
+if (engine == ENGINE_BTREE)
+  return btree.height();
+
+return treeHeightRecursive(root);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treePrintInOrderRecursive(TwoDITNode* x, const int &depth) const {
+
+if (x != &nil) {
+  treePrintInOrderRecursive(x->left, depth + 1);
+  std::cout<<" ("<<x->interval->GetId()<<","<<x->interval->GetLowPoint()<<","<<x->interval->GetHighPoint()
+           <<","<<x->interval->GetTimeStamp()<<"):("<<KeyTraits::deref(x->max_high)<<","<<x->max_timestamp
+           <<","<<(x->is_red ? 'R' : 'B')<<","<<depth<<")";
+  treePrintInOrderRecursive(x->right, depth + 1);
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+int TwoDITwTopKT<Key, Compare>::treeHeightRecursive(TwoDITNode* x) const {
+
+if (x == &nil)
+  return 0;
+
+int hl = treeHeightRecursive(x->left), hr = treeHeightRecursive(x->right);
+
+if (hl > hr)
+  return hl + 1;
+
+return hr + 1;
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::indexInOrder(const TwoDITNode* x, const BTreeNode* b, std::vector<const TwoDInterval*> &intervals) const {
+
+if (engine == ENGINE_BTREE)
+  btree.inOrder(b, intervals);
+else
+  treeInOrder(x, intervals);
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treeInOrder(const TwoDITNode* x, std::vector<const TwoDInterval*> &intervals) const {
+
+// an explicit stack, since without parent pointers there is no successor walk
+std::vector<const TwoDITNode*> stack;
+
+while (x != &nil or !stack.empty()) {
+  while (x != &nil) {
+    stack.push_back(x);
+    x = x->left;
+  }
+  
+  x = stack.back();
+  stack.pop_back();
+  intervals.push_back(x->interval);
+  x = x->right;
+}
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TwoDITwTopKT<Key, Compare>::treeVisit(const TwoDITNode* x, const typename KeyTraits::Ref &low, const typename KeyTraits::Ref &high, const Visitor &visit) const {
+
+if (x == &nil or TwoDInterval::lowerRef(x->max_high, low))
+  return true;
+
+if (!treeVisit(x->left, low, high, visit))
+  return false;
+
+// x and its right sub-tree start after the query interval
+if (TwoDInterval::lowerRef(high, x->low))
+  return true;
+
+if (nodeOverlaps<TwoDInterval>(x, low, high) and !visit(*x->interval))
+  return false;
+
+return treeVisit(x->right, low, high, visit);
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TwoDITwTopKT<Key, Compare>::imageVisit(const uint32_t &x, const std::string &minKey, const std::string &maxKey, const Visitor &visit) const {
+
+if (x == TwoDITImage::nil or image.compareMaxHigh(x, minKey) < 0)
+  return true;
+
+const TwoDITImageNode &n = image.node(x);
+
+if (!imageVisit(n.left, minKey, maxKey, visit))
+  return false;
+
+// x and its right sub-tree start after the query interval
+if (image.compareLow(x, maxKey) > 0)
+  return true;
+
+if (image.overlaps(x, minKey, maxKey)) {
+  TwoDInterval interval;
+  imageGetInterval(interval, x);
+  
+  if (!visit(interval))
+    return false;
+}
+
+return imageVisit(n.right, minKey, maxKey, visit);
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TwoDITwTopKT<Key, Compare>::treeVisitBatch(const TwoDITNode* x, const std::vector<BatchRange<typename KeyTraits::Ref> > &ranges, const size_t &begin, const size_t &end, const BatchVisitor &visit) const {
+
+typedef BatchRange<typename KeyTraits::Ref> Range;
+
+if (x == &nil)
+  return true;
+
+// drop the ranges starting after everything below x
+size_t last = std::partition_point(ranges.begin() + begin, ranges.begin() + end, [x](const Range &r) {
+  return !TwoDInterval::lowerRef(x->max_high, r.low);
+}) - ranges.begin();
+
+if (begin == last)
+  return true;
 
-sync();
-treeDestroy(root);
+if (!treeVisitBatch(x->left, ranges, begin, last, visit))
+  return false;
+
+// x and its right sub-tree start at x->low, past every range that ends before it
+size_t first = std::partition_point(ranges.begin() + begin, ranges.begin() + last, [x](const Range &r) {
+  return TwoDInterval::lowerRef(r.reach, x->low);
+}) - ranges.begin();
+
+for (size_t i = first; i < last and !TwoDInterval::lowerRef(x->high, ranges[i].low); i++) {
+  if (nodeOverlaps<TwoDInterval>(x, ranges[i].low, ranges[i].high) and !visit(*x->interval, ranges[i].index))
+    return false;
+}
+
+return first == last or treeVisitBatch(x->right, ranges, first, last, visit);
 };
 
 
 //
-void TwoDITwTopK::insertInterval(const std::string &id, const std::string &minKey, const std::string &maxKey, const uint64_t &maxTimestamp) {
+template <typename Key, typename Compare>
+bool TwoDITwTopKT<Key, Compare>::btreeVisitBatch(const BTreeNode* x, const std::vector<BatchRange<typename KeyTraits::Ref> > &ranges, const size_t &begin, const size_t &end, const BatchVisitor &visit) const {
 
-try {
-  if (iterator_in_use)
-    iterator->stop();
-  
-  if (id == "")
-    throw std::runtime_error("Empty interval ID string");
+typedef BatchRange<typename KeyTraits::Ref> Range;
+
+// entry i covers [low[i], high[i]], so it gets the window of ranges that can reach into it
+for (uint32_t i = 0; i < x->count; i++) {
   
-  TwoDITNode *z = new TwoDITNode;
+  // entries are in low point order, so the rest start after every range
+  if (TwoDInterval::lowerRef(ranges[end - 1].reach, x->low[i]))
+    break;
   
-  std::list<std::string> r;
-  split(r, id, id_delim);
+  size_t last = std::partition_point(ranges.begin() + begin, ranges.begin() + end, [x, i](const Range &r) {
+    return !TwoDInterval::lowerRef(x->high[i], r.low);
+  }) - ranges.begin();
+  size_t first = std::partition_point(ranges.begin() + begin, ranges.begin() + last, [x, i](const Range &r) {
+    return TwoDInterval::lowerRef(r.reach, x->low[i]);
+  }) - ranges.begin();
   
-  if (ids.find(r.front()) == ids.end()) {
-    // create empty unordered_set for new key
-    ids[r.front()] = std::unordered_set<std::string>();
+  if (!x->leaf) {
+    if (first < last and !btreeVisitBatch(x->child[i], ranges, first, last, visit))
+      return false;
+    continue;
   }
-  else if (ids[r.front()].find(r.back()) != ids[r.front()].end()) {
-    // existing id is being rewritten, so delete the old interval from storage
-    deleteInterval(id);
-  }
-  
-  ids[r.front()].insert(r.back());
   
-  storage[id] = z;
-  
-  z->interval = TwoDInterval(id, minKey, maxKey, maxTimestamp);
-  treeInsert(z);
-    
-  if (++sync_counter > sync_threshold) { sync(); }
-}
-catch(std::exception &e) {
-  std::cerr<<std::endl<<"Insert failure: "<<e.what()<<std::endl;
+  for (size_t j = first; j < last; j++) {
+    if (!TwoDInterval::lowerRef(ranges[j].high, x->low[i]) and !visit(*x->first[i], ranges[j].index))
+      return false;
+  }
 }
+
+return true;
 };
 
 
 //
-void TwoDITwTopK::deleteInterval(const std::string &id) {
+template <typename Key, typename Compare>
+bool TwoDITwTopKT<Key, Compare>::imageVisitBatch(const uint32_t &x, const std::vector<BatchRange<std::string> > &ranges, const size_t &begin, const size_t &end, const BatchVisitor &visit) const {
 
-if(iterator_in_use)
-  iterator->stop();
+typedef BatchRange<std::string> Range;
 
-if (storage.find(id) != storage.end()) {
-  
-  std::list<std::string> r;
-  split(r, id, id_delim);
-  
-  ids[r.front()].erase(r.back());
-  if (ids[r.front()].empty())
-    ids.erase(r.front());
-  
-  treeDelete(storage[id]);
+if (x == TwoDITImage::nil)
+  return true;
 
-  storage.erase(id);
+// same walk as treeVisitBatch, over image node indices
+size_t last = std::partition_point(ranges.begin() + begin, ranges.begin() + end, [this, x](const Range &r) {
+  return image.compareMaxHigh(x, r.low) >= 0;
+}) - ranges.begin();
 
-  if (++sync_counter > sync_threshold) { sync(); }
-}
-};
+if (begin == last)
+  return true;
 
+if (!imageVisitBatch(image.node(x).left, ranges, begin, last, visit))
+  return false;
 
-//
-void TwoDITwTopK::deleteAllIntervals(const std::string &id_prefix) {
-if (ids.find(id_prefix) != ids.end()) {
-  std::list<std::string> intervals_to_delete;
+size_t first = std::partition_point(ranges.begin() + begin, ranges.begin() + last, [this, x](const Range &r) {
+  return image.compareLow(x, r.reach) > 0;
+}) - ranges.begin();
+TwoDInterval interval;
+bool loaded = false;
+
+for (size_t i = first; i < last and image.compareHigh(x, ranges[i].low) >= 0; i++) {
+  if (!image.overlaps(x, ranges[i].low, ranges[i].high))
+    continue;
   
-  for (std::unordered_set<std::string>::iterator it = ids[id_prefix].begin(); it != ids[id_prefix].end(); it++) {
-    intervals_to_delete.push_back((*it == "") ? id_prefix : id_prefix + id_delim + *it);
+  if (!loaded) {
+    imageGetInterval(interval, x);
+    loaded = true;
   }
   
-  for (std::list<std::string>::iterator it = intervals_to_delete.begin(); it != intervals_to_delete.end(); it++) {
-    deleteInterval(*it);
-  }
+  if (!visit(interval, ranges[i].index))
+    return false;
 }
-};
-
-
-//
-void TwoDITwTopK::getInterval(TwoDInterval &ret_interval, const std::string &id) const {
-
-std::list<std::string> r;
-split(r, id, id_delim);
-
-if (ids.find(r.front()) != ids.end() and ids.at(r.front()).find(r.back()) != ids.at(r.front()).end())
-  ret_interval = storage.at(id)->interval;
-else
-  ret_interval = TwoDInterval("", "", "", 0LL);
 
+return first == last or imageVisitBatch(image.node(x).right, ranges, first, last, visit);
 };
 
 
 //
-void TwoDITwTopK::topK(std::vector<TwoDInterval> &ret_value, const std::string &minKey, const std::string &maxKey) {
-
-TwoDInterval test("", minKey, maxKey, 0LL);
-TwoDITNode *x;
-std::unordered_set<TwoDITNode*> found;
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::imageGetInterval(TwoDInterval &ret_interval, const uint32_t &x) const {
 
-while(treeIntervalSearch(test, found, x))
-  ret_value.push_back(x->interval);
+std::string id, low, high;
+uint64_t timestamp;
 
-std::sort(ret_value.begin(), ret_value.end(), std::greater<TwoDInterval>());
+image.getInterval(id, low, high, timestamp, x);
+ret_interval = TwoDInterval(idFromBytes(id), KeyTraits::decode(low), KeyTraits::decode(high), timestamp);
 };
 
 
 //
-void TwoDITwTopK::sync() const {
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treeTopK(std::vector<const TwoDInterval*> &ret_value, const TwoDITNode* x, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
 
-std::ofstream ofile(sync_file.c_str());
+typename KeyTraits::Ref low = KeyTraits::ref(minKey), high = KeyTraits::ref(maxKey);
+std::vector<SearchItem<const TwoDITNode*> > heap;
+size_t found = 0;
 
-if (ofile.is_open()) {
-  std::list<TwoDInterval> l;
+treePush(heap, x, low, high, minTimestamp, maxTimestamp);
+
+while (!heap.empty() and found < k) {
+  
+  std::pop_heap(heap.begin(), heap.end(), heapCompareItem<SearchItem<const TwoDITNode*> >);
+  SearchItem<const TwoDITNode*> item = heap.back();
+  heap.pop_back();
   
-  for (std::unordered_map<std::string, TwoDITNode*>::const_iterator it = storage.begin(); it != storage.end(); it++) {
-    l.push_back(it->second->interval);
+  if (item.index >= 0) {
+    ret_value.push_back(item.node->interval);
+    found++;
   }
-
-  ofile.write((char *)&l, sizeof(l));
-  ofile.close();
+  else
+    treeExpand(heap, item.node, low, high, minTimestamp, maxTimestamp);
 }
-
-sync_counter = 0;
 };
 
 
 //
-void TwoDITwTopK::setSyncFile(const std::string &filename) { sync_file = filename; };
-void TwoDITwTopK::getSyncFile(std::string &filename) const { filename = sync_file; };
-
-void TwoDITwTopK::setSyncThreshold(const uint32_t &threshold) { sync_threshold = threshold; };
-void TwoDITwTopK::getSyncThreshold(uint32_t &threshold) const { threshold = sync_threshold; };
-
-void TwoDITwTopK::setIdDelimiter(const char &delim) { id_delim = delim; };
-void TwoDITwTopK::getIdDelimiter(char &delim) const { delim = id_delim; };
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treePush(std::vector<SearchItem<const TwoDITNode*> > &heap, const TwoDITNode* x, const typename KeyTraits::Ref &low, const typename KeyTraits::Ref &high, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
+
+// the sub-tree's keys span [min_low, max_high] and its timestamps [min_timestamp, max_timestamp],
+// so it is queued only if both meet the query, ranked by the newest timestamp it may hold
+if (x == &nil or TwoDInterval::lowerRef(x->max_high, low) or TwoDInterval::lowerRef(high, x->min_low)
+    or !timeOverlaps(x->min_timestamp, x->max_timestamp, minTimestamp, maxTimestamp))
+  return;
+
+SearchItem<const TwoDITNode*> item = {x, -1, min2<uint64_t>(x->max_timestamp, maxTimestamp)};
+heap.push_back(item);
+std::push_heap(heap.begin(), heap.end(), heapCompareItem<SearchItem<const TwoDITNode*> >);
+};
 
 
 //
-void TwoDITwTopK::storagePrint() const {
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treeExpand(std::vector<SearchItem<const TwoDITNode*> > &heap, const TwoDITNode* x, const typename KeyTraits::Ref &low, const typename KeyTraits::Ref &high, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
+
+uint64_t t = x->interval->GetTimeStamp();
 
-for (std::unordered_map<std::string, TwoDITNode*>::const_iterator it = storage.begin(); it != storage.end(); it++) {
-  std::cout<<"("<<it->second->interval.GetId()<<","<<it->second->interval.GetLowPoint()<<","<<it->second->interval.GetHighPoint()
-        <<","<<it->second->interval.GetTimeStamp()<<")"<<"\n";
+// x's own interval is queued with its timestamp, below which its sub-trees may still rank
+if (timeOverlaps(t, t, minTimestamp, maxTimestamp) and nodeOverlaps<TwoDInterval>(x, low, high)) {
+  SearchItem<const TwoDITNode*> item = {x, 0, t};
+  heap.push_back(item);
+  std::push_heap(heap.begin(), heap.end(), heapCompareItem<SearchItem<const TwoDITNode*> >);
 }
+
+treePush(heap, x->left, low, high, minTimestamp, maxTimestamp);
+treePush(heap, x->right, low, high, minTimestamp, maxTimestamp);
 };
 
 
 //
-void TwoDITwTopK::treePrintLevelOrder() const {
-int depth, level=0;
-TwoDITNode* x;
-std::deque<std::pair<TwoDITNode*, int>> nodes;
-std::stringstream line1, line2, line3, buffer;
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::btreeTopK(std::vector<const TwoDInterval*> &ret_value, const BTreeNode* x, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
 
-if (root != &nil) {
-  nodes.push_back(std::make_pair(root, 0));
-}
+typename KeyTraits::Ref low = KeyTraits::ref(minKey), high = KeyTraits::ref(maxKey);
+std::vector<SearchItem<const BTreeNode*> > heap;
+size_t found = 0;
 
-while (!nodes.empty()) {
-  x = nodes.front().first;
-  depth = nodes.front().second;
-  nodes.pop_front();
-  
-  if (depth != level) {
-    std::cout<<line1.str()<<std::endl<<line2.str()<<std::endl<<line3.str()<<std::endl<<std::endl;
-    line1.str(std::string());
-    line2.str(std::string());
-    line3.str(std::string());
-    level++;
-  }
-  
-  buffer<<"("<<x->interval.GetId()<<","<<x->interval.GetLowPoint()<<","<<x->interval.GetHighPoint()
-        <<","<<x->interval.GetTimeStamp()<<")";
-  line1<<std::setw(13)<<buffer.str();
-  buffer.str(std::string());
+if (x != nullptr)
+  btreeExpand(heap, x, low, high, minTimestamp, maxTimestamp);
 
-  buffer<<"("<<x->max_high<<","<<x->max_timestamp<<","<<(x->is_red ? 'R' : 'B')<<")";
-  line2<<std::setw(13)<<buffer.str();
-  buffer.str(std::string());
+while (!heap.empty() and found < k) {
   
-  if (x->left != &nil) {
-    nodes.push_back(std::make_pair(x->left, depth+1));
-    buffer<<'/'<<x->left->interval.GetId();
-  }
-  buffer<<"    ";
+  std::pop_heap(heap.begin(), heap.end(), heapCompareItem<SearchItem<const BTreeNode*> >);
+  SearchItem<const BTreeNode*> item = heap.back();
+  heap.pop_back();
   
-  if (x->right != &nil) {
-    nodes.push_back(std::make_pair(x->right, depth+1));
-    buffer<<'\\'<<x->right->interval.GetId();
+  if (item.index >= 0) {
+    ret_value.push_back(item.node->first[item.index]);
+    found++;
   }
-  line3<<std::setw(13)<<buffer.str();
-  buffer.str(std::string());
+  else
+    btreeExpand(heap, item.node, low, high, minTimestamp, maxTimestamp);
 }
-
-std::cout<<line1.str()<<std::endl<<line2.str()<<std::endl;
 };
 
 
 //
-void TwoDITwTopK::treePrintInOrder() const {
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::btreeExpand(std::vector<SearchItem<const BTreeNode*> > &heap, const BTreeNode* x, const typename KeyTraits::Ref &low, const typename KeyTraits::Ref &high, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
 
-treePrintInOrderRecursive(root, 0);
-std::cout<<std::endl;
+// a child is queued with the newest timestamp it may hold in the window and a leaf's interval
+// with its own, so popping the heap yields the overlapping intervals newest first
+for (uint32_t i = 0; i < x->count; i++) {
+  
+  // entries are in low point order, so the rest start after the query interval
+  if (TwoDInterval::lowerRef(high, x->low[i]))
+    break;
+  
+  if (TwoDInterval::lowerRef(x->high[i], low) or !timeOverlaps(x->min_timestamp[i], x->timestamp[i], minTimestamp, maxTimestamp))
+    continue;
+  
+  SearchItem<const BTreeNode*> item = {x->leaf ? x : x->child[i], x->leaf ? (int)i : -1, min2<uint64_t>(x->timestamp[i], maxTimestamp)};
+  heap.push_back(item);
+  std::push_heap(heap.begin(), heap.end(), heapCompareItem<SearchItem<const BTreeNode*> >);
+}
 };
 
 
 //
-int TwoDITwTopK::treeHeight() const {
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::imageTopK(std::vector<TwoDInterval> &ret_value, const std::string &minKey, const std::string &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
 
-return treeHeightRecursive(root);
-};
+std::vector<SearchItem<uint32_t> > heap;
+size_t found = 0;
 
+if (image.size() > 0)
+  imagePush(heap, image.root(), minKey, maxKey, minTimestamp, maxTimestamp);
 
-//
-void TwoDITwTopK::treePrintInOrderRecursive(TwoDITNode* x, const int &depth) const {
-
-if (x != &nil) {
-  treePrintInOrderRecursive(x->left, depth + 1);
-  std::cout<<" ("<<x->interval.GetId()<<","<<x->interval.GetLowPoint()<<","<<x->interval.GetHighPoint()
-           <<","<<x->interval.GetTimeStamp()<<"):("<<x->max_high<<","<<x->max_timestamp
-           <<","<<(x->is_red ? 'R' : 'B')<<","<<depth<<")";
-  treePrintInOrderRecursive(x->right, depth + 1);
+// same search as treeTopK, over image node indices
+while (!heap.empty() and found < k) {
+  
+  std::pop_heap(heap.begin(), heap.end(), heapCompareItem<SearchItem<uint32_t> >);
+  SearchItem<uint32_t> item = heap.back();
+  heap.pop_back();
+  
+  if (item.index >= 0) {
+    ret_value.push_back(TwoDInterval());
+    imageGetInterval(ret_value.back(), item.node);
+    found++;
+  }
+  else
+    imageExpand(heap, item.node, minKey, maxKey, minTimestamp, maxTimestamp);
 }
 };
 
 
 //
-int TwoDITwTopK::treeHeightRecursive(TwoDITNode* x) const {
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::imagePush(std::vector<SearchItem<uint32_t> > &heap, const uint32_t &x, const std::string &minKey, const std::string &maxKey, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
 
-if (x == &nil)
-  return 0;
+if (x == TwoDITImage::nil or image.compareMaxHigh(x, minKey) < 0 or image.compareMinLow(x, maxKey) > 0)
+  return;
 
-int hl = treeHeightRecursive(x->left), hr = treeHeightRecursive(x->right);
+const TwoDITImageNode &n = image.node(x);
 
-if (hl > hr)
-  return hl + 1;
+if (!timeOverlaps(n.min_timestamp, n.max_timestamp, minTimestamp, maxTimestamp))
+  return;
 
-return hr + 1;
+SearchItem<uint32_t> item = {x, -1, min2<uint64_t>(n.max_timestamp, maxTimestamp)};
+heap.push_back(item);
+std::push_heap(heap.begin(), heap.end(), heapCompareItem<SearchItem<uint32_t> >);
 };
 
 
 //
-bool TwoDITwTopK::treeIntervalSearch(const TwoDInterval &test_interval, std::unordered_set<TwoDITNode*> &found, TwoDITNode *&x) const {
-  
-  x = root;
-  
-  while (x != &nil) {
-  
-  if (x->interval * test_interval and found.find(x) == found.end()) {
-    found.insert(x);
-    return true;
-  }
-  else if (x->left == &nil)
-    x = x->right;
-  else if (x->left->max_high < test_interval.GetLowPoint())
-    x = x->right;
-  else
-    x = x->left;
-  }
-  
-  return false;
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::imageExpand(std::vector<SearchItem<uint32_t> > &heap, const uint32_t &x, const std::string &minKey, const std::string &maxKey, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const {
+
+const TwoDITImageNode &n = image.node(x);
+
+if (timeOverlaps(n.timestamp, n.timestamp, minTimestamp, maxTimestamp) and image.overlaps(x, minKey, maxKey)) {
+  SearchItem<uint32_t> item = {x, 0, n.timestamp};
+  heap.push_back(item);
+  std::push_heap(heap.begin(), heap.end(), heapCompareItem<SearchItem<uint32_t> >);
+}
+
+imagePush(heap, n.left, minKey, maxKey, minTimestamp, maxTimestamp);
+imagePush(heap, n.right, minKey, maxKey, minTimestamp, maxTimestamp);
 };
 
 
 //
-void TwoDITwTopK::treeInsert(TwoDITNode* z) {
-TwoDITNode *y = &nil, *x = root;
+template <typename Key, typename Compare>
+typename TwoDITwTopKT<Key, Compare>::TwoDITNode* TwoDITwTopKT<Key, Compare>::treeBuild(const std::vector<const TwoDInterval*> &intervals, const size_t &lo, const size_t &hi, const int &depth, const int &red_depth) {
+
+if (lo >= hi)
+  return &nil;
+
+size_t mid = lo + (hi - lo) / 2;
+TwoDITNode *x = node_pool.create();
+
+x->interval = intervals[mid];
+x->low = KeyTraits::ref(x->interval->GetLowPoint());
+x->high = KeyTraits::ref(x->interval->GetHighPoint());
+x->version = write_version;
+x->left = treeBuild(intervals, lo, mid, depth + 1, red_depth);
+x->right = treeBuild(intervals, mid + 1, hi, depth + 1, red_depth);
+x->is_red = (depth == red_depth);
+treeSetMaxFields(x);
+
+return x;
+};
 
-z->max_high = z->interval.GetHighPoint();
-z->max_timestamp = z->interval.GetTimeStamp();
 
-while (x != &nil) {
-  y = x;
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treeInsert(TwoDITNode* z) {
+TwoDITNode **link = &root, *x;
+
+z->low = KeyTraits::ref(z->interval->GetLowPoint());
+z->high = KeyTraits::ref(z->interval->GetHighPoint());
+z->max_high = z->high;
+z->min_low = z->low;
+z->max_timestamp = z->interval->GetTimeStamp();
+z->min_timestamp = z->max_timestamp;
+z->version = write_version;
+
+path.clear();
+
+while (*link != &nil) {
+  x = treeWritable(link);
+  path.push_back(x);
   
-  if (y->max_high < z->max_high)
-    y->max_high = z->max_high;
-  if (y->max_timestamp < z->max_timestamp)
-    y->max_timestamp = z->max_timestamp;
+  if (TwoDInterval::lowerRef(x->max_high, z->max_high))
+    x->max_high = z->max_high;
+  if (TwoDInterval::lowerRef(z->low, x->min_low))
+    x->min_low = z->low;
+  if (x->max_timestamp < z->max_timestamp)
+    x->max_timestamp = z->max_timestamp;
+  if (x->min_timestamp > z->min_timestamp)
+    x->min_timestamp = z->min_timestamp;
   
-  if (z->interval.GetLowPoint() < x->interval.GetLowPoint())
-    x = x->left;
+  if (lowerKeyed(z->low, z->interval, x->low, x->interval))
+    link = &x->left;
   else
-    x = x->right;
+    link = &x->right;
 }
 
-z->parent = y;
-if (y == &nil)
-  root = z;
-else
-  if (z->interval.GetLowPoint() < y->interval.GetLowPoint())
-    y->left = z;
-  else
-    y->right = z;
+*link = z;
+path.push_back(z);
 
 z->left = &nil;
 z->right = &nil;
 z->is_red = true;
 
-treeInsertFixup(z);
+treeInsertFixup();
 };
 
 
 //
-void TwoDITwTopK::treeInsertFixup(TwoDITNode* z) {
-TwoDITNode *y;
-
-while (z->parent->is_red) {
-  if (z->parent == z->parent->parent->left) {
-    y = z->parent->parent->right;
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treeInsertFixup() {
+size_t i = path.size() - 1;
+TwoDITNode *p, *g, *y;
+
+// a red parent is never the root, so path[i - 2] exists whenever path[i - 1] is red
+while (i > 0 and path[i - 1]->is_red) {
+  p = path[i - 1];
+  g = path[i - 2];
+  if (p == g->left) {
+    y = g->right;
     if (y->is_red) {
-      z->parent->is_red = false;
+      y = treeWritable(&g->right);
+      p->is_red = false;
       y->is_red = false;
-      z->parent->parent->is_red = true;
-      z = z->parent->parent;
+      g->is_red = true;
+      i -= 2;
     }
     else {
-      if (z == z->parent->right) {
-        z = z->parent;
-        treeLeftRotate(z);
+      if (path[i] == p->right) {
+        treeLeftRotate(&g->left);
+        std::swap(path[i - 1], path[i]);
+        p = path[i - 1];
       }
-      z->parent->is_red = false;
-      z->parent->parent->is_red = true;
-      treeRightRotate(z->parent->parent);
+      p->is_red = false;
+      g->is_red = true;
+      treeRightRotate(treeLink(i - 2));
+      break;
     }
   }
   else {
-    y = z->parent->parent->left;
+    y = g->left;
     if (y->is_red) {
-      z->parent->is_red = false;
+      y = treeWritable(&g->left);
+      p->is_red = false;
       y->is_red = false;
-      z->parent->parent->is_red = true;
-      z = z->parent->parent;
+      g->is_red = true;
+      i -= 2;
     }
     else {
-      if (z == z->parent->left) {
-        z = z->parent;
-        treeRightRotate(z);
+      if (path[i] == p->left) {
+        treeRightRotate(&g->right);
+        std::swap(path[i - 1], path[i]);
+        p = path[i - 1];
       }
-      z->parent->is_red = false;
-      z->parent->parent->is_red = true;
-      treeLeftRotate(z->parent->parent);
+      p->is_red = false;
+      g->is_red = true;
+      treeLeftRotate(treeLink(i - 2));
+      break;
     }
   }
 }
@@ -483,101 +3007,142 @@ root->is_red = false;
 
 
 //
-void TwoDITwTopK::treeDelete(TwoDITNode* z) {
-TwoDITNode *y = z, *x;
-bool y_orig_is_red = y->is_red;
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treeDelete(const TwoDInterval* interval) {
+TwoDITNode **link = &root, **z_link, *z, *y, *x;
+typename KeyTraits::Ref low = KeyTraits::ref(interval->GetLowPoint());
 
+path.clear();
 
-if (z->left == &nil) {
-  x = z->right;
-  treeTransplant(z, x);
+// find the interval's node, copying the path to it as needed
+while (true) {
+  if (*link == &nil)
+    return;
+  
+  z = treeWritable(link);
+  path.push_back(z);
+  
+  if (z->interval == interval)
+    break;
+  
+  if (lowerKeyed(low, interval, z->low, z->interval))
+    link = &z->left;
+  else
+    link = &z->right;
 }
-else if (z->right == &nil) {
-  x = z->left;
-  treeTransplant(z, x);
+
+size_t z_index = path.size() - 1;
+bool removed_red = z->is_red, x_left = (z_index > 0 and path[z_index - 1]->left == z);
+z_link = link;
+
+if (z->left == &nil or z->right == &nil) {
+  x = (z->left == &nil) ? z->right : z->left;
+  *z_link = x;
+  path.back() = x;
 }
 else {
-  y = treeMinimum(z->right);
-  y_orig_is_red = y->is_red;
-  x = y->right;
-  if (y->parent == z) {
-    x->parent = y;
-  }
-  else {
-    treeTransplant(y, x);
-    y->right = z->right;
-    y->right->parent = y;
+  // splice out z's successor y and put it in z's place
+  link = &z->right;
+  y = treeWritable(link);
+  path.push_back(y);
+  x_left = false;
+  
+  while (y->left != &nil) {
+    link = &y->left;
+    y = treeWritable(link);
+    path.push_back(y);
+    x_left = true;
   }
-  treeTransplant(z, y);
+  
+  removed_red = y->is_red;
+  x = y->right;
+  *link = x;
+  
   y->left = z->left;
-  y->left->parent = y;
+  y->right = z->right;
   y->is_red = z->is_red;
+  *z_link = y;
+  
+  path[z_index] = y;
+  path.back() = x;
 }
 
-treeMaxFieldsFixup(x->parent);
-
-if (!y_orig_is_red)
-  treeDeleteFixup(x);
+treeRetire(z);
+treeMaxFieldsFixup(z_index);
 
-delete z;
+if (!removed_red)
+  treeDeleteFixup(x_left);
 };
 
 
 //
-void TwoDITwTopK::treeDeleteFixup(TwoDITNode* x) {
-TwoDITNode *w;
-
-while (x != root and !x->is_red) {
-  if (x == x->parent->left) {
-    w = x->parent->right;
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treeDeleteFixup(bool x_left) {
+size_t k = path.size() - 1;
+TwoDITNode *x = path[k], *p, *w;
+
+while (k > 0 and !x->is_red) {
+  p = path[k - 1];
+  if (x_left) {
+    w = treeWritable(&p->right);
     if (w->is_red) {
       w->is_red = false;
-      x->parent->is_red = true;
-      treeLeftRotate(x->parent);
-      w = x->parent->right;
+      p->is_red = true;
+      treeLeftRotate(treeLink(k - 1));
+      path.insert(path.begin() + (k - 1), w);
+      k++;
+      w = treeWritable(&p->right);
     }
     if (!w->left->is_red and !w->right->is_red) {
       w->is_red = true;
-      x = x->parent;
+      x = p;
+      path.resize(k--);
+      x_left = (k > 0 and path[k - 1]->left == x);
     }
     else {
       if (!w->right->is_red) {
-        w->left->is_red = false;
+        treeWritable(&w->left)->is_red = false;
         w->is_red = true;
-        treeRightRotate(w);
-        w = x->parent->right;
+        treeRightRotate(&p->right);
+        w = p->right;
       }
-      w->is_red = x->parent->is_red;
-      x->parent->is_red = false;
-      w->right->is_red = false;
-      treeLeftRotate(x->parent);
+      w->is_red = p->is_red;
+      p->is_red = false;
+      treeWritable(&w->right)->is_red = false;
+      treeLeftRotate(treeLink(k - 1));
       x = root;
+      k = 0;
     }
   }
   else {
-    w = x->parent->left;
+    w = treeWritable(&p->left);
     if (w->is_red) {
       w->is_red = false;
-      x->parent->is_red = true;
-      treeRightRotate(x->parent);
-      w = x->parent->left;
+      p->is_red = true;
+      treeRightRotate(treeLink(k - 1));
+      path.insert(path.begin() + (k - 1), w);
+      k++;
+      w = treeWritable(&p->left);
     }
     if (!w->left->is_red and !w->right->is_red) {
       w->is_red = true;
-      x = x->parent;
+      x = p;
+      path.resize(k--);
+      x_left = (k > 0 and path[k - 1]->left == x);
     }
     else {
       if (!w->left->is_red) {
-        w->right->is_red = false;
+        treeWritable(&w->right)->is_red = false;
         w->is_red = true;
-        treeLeftRotate(w);
-        w = x->parent->left;
+        treeLeftRotate(&p->left);
+        w = p->left;
       }
-      w->is_red = x->parent->is_red;
-      x->parent->is_red = false;
-      w->left->is_red = false;
-      treeRightRotate(x->parent);
+      w->is_red = p->is_red;
+      p->is_red = false;
+      treeWritable(&w->left)->is_red = false;
+      treeRightRotate(treeLink(k - 1));
       x = root;
+      k = 0;
     }
   }
 }
@@ -587,239 +3152,281 @@ x->is_red = false;
 
 
 //
-TwoDITNode* TwoDITwTopK::treeMinimum(TwoDITNode* x) const {
+template <typename Key, typename Compare>
+typename TwoDITwTopKT<Key, Compare>::TwoDITNode** TwoDITwTopKT<Key, Compare>::treeLink(const size_t &i) {
 
-while (x->left != &nil)
-  x = x->left;
+if (i == 0)
+  return &root;
 
-return x;
+if (path[i - 1]->left == path[i])
+  return &path[i - 1]->left;
+
+return &path[i - 1]->right;
 };
 
 
 //
-TwoDITNode* TwoDITwTopK::treeSuccessor(TwoDITNode* x) const {
+template <typename Key, typename Compare>
+typename TwoDITwTopKT<Key, Compare>::TwoDITNode* TwoDITwTopKT<Key, Compare>::treeWritable(TwoDITNode** link) {
 
-if (x->right != &nil)
-  return treeMinimum(x->right);
+TwoDITNode *x = *link;
 
-TwoDITNode* y = x->parent;
+if (x == &nil or x->version > frozen_version)
+  return x;
 
-while (y != &nil and x == y->right) {
-  x = y;
-  y = y->parent;
-}
+// x is shared with a snapshot, so the live tree gets a copy
+TwoDITNode *y = node_pool.create(*x);
+y->version = write_version;
+retired_nodes.push_back(std::make_pair(write_version, x));
+*link = y;
 
 return y;
 };
 
 
 //
-void TwoDITwTopK::treeLeftRotate(TwoDITNode* x) {
-
-TwoDITNode* y = x->right;
-x->right = y->left;
-if (y->left != &nil)
-  y->left->parent = x;
-y->parent = x->parent;
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treeRetire(TwoDITNode* x) {
 
-if (x->parent == &nil)
-  root = y;
+if (x->version > frozen_version)
+  node_pool.destroy(x);
 else
-  if (x == x->parent->left)
-    x->parent->left = y;
-  else
-    x->parent->right = y;
-
-y->left= x;
-x->parent = y;
-
-y->max_high = x->max_high;
-y->max_timestamp = x->max_timestamp;
-treeSetMaxFields(x);
+  retired_nodes.push_back(std::make_pair(write_version, x));
 };
 
 
 //
-void TwoDITwTopK::treeRightRotate(TwoDITNode* x) {
-
-TwoDITNode* y = x->left;
-x->left = y->right;
-if (y->right != &nil)
-  y->right->parent = x;
-y->parent = x->parent;
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::intervalRetire(const TwoDInterval* interval) {
 
-if (x->parent == &nil)
-  root = y;
+if (frozen_version == 0)
+  interval_pool.destroy(interval);
 else
-  if (x == x->parent->right)
-    x->parent->right = y;
-  else
-    x->parent->left = y;
+  retired_intervals.push_back(std::make_pair(write_version, interval));
+};
+
+
+//
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treeLeftRotate(TwoDITNode** link) {
 
-y->right= x;
-x->parent = y;
+TwoDITNode* x = *link;
+TwoDITNode* y = treeWritable(&x->right);
+x->right = y->left;
+y->left = x;
+*link = y;
 
 y->max_high = x->max_high;
+y->min_low = x->min_low;
 y->max_timestamp = x->max_timestamp;
+y->min_timestamp = x->min_timestamp;
 treeSetMaxFields(x);
 };
 
 
 //
-void TwoDITwTopK::treeTransplant(TwoDITNode* u, TwoDITNode* v) {
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treeRightRotate(TwoDITNode** link) {
 
-if (u->parent == &nil)
-  root = v;
-else if (u == u->parent->left)
-  u->parent->left = v;
-else
-  u->parent->right = v;
+TwoDITNode* x = *link;
+TwoDITNode* y = treeWritable(&x->left);
+x->left = y->right;
+y->right = x;
+*link = y;
 
-v->parent = u->parent;
+y->max_high = x->max_high;
+y->min_low = x->min_low;
+y->max_timestamp = x->max_timestamp;
+y->min_timestamp = x->min_timestamp;
+treeSetMaxFields(x);
 };
 
 
 //
-void TwoDITwTopK::treeMaxFieldsFixup(TwoDITNode* x) {
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treeMaxFieldsFixup(const size_t &z_index) {
 
-std::string old_high;
-uint64_t old_timestamp;
+typename KeyTraits::Ref old_high, old_low;
+uint64_t old_timestamp, old_min_timestamp;
+TwoDITNode *x;
 
-while (x != &nil) {
+for (size_t i = path.size() - 1; i-- > 0;) {
   
+  x = path[i];
   old_high = x->max_high;
+  old_low = x->min_low;
   old_timestamp = x->max_timestamp;
+  old_min_timestamp = x->min_timestamp;
   treeSetMaxFields(x);
   
-  // early exemption
-  if (x->max_high == old_high and x->max_timestamp == old_timestamp)
+  // early exemption, once past the node that replaced the deleted one; the same key
+  // reference means the same key
+  if (i < z_index and x->max_high == old_high and x->min_low == old_low and x->max_timestamp == old_timestamp and x->min_timestamp == old_min_timestamp)
     break;
-  
-  x = x->parent;
 }
 };
 
 
 //
-void TwoDITwTopK::treeSetMaxFields(TwoDITNode* x) {
+template <typename Key, typename Compare>
+void TwoDITwTopKT<Key, Compare>::treeSetMaxFields(TwoDITNode* x) {
+
+x->min_low = (x->left != &nil) ? x->left->min_low : x->low;
 
 if (x->left != &nil)
   if (x->right != &nil) {
-    x->max_high = max3<std::string>(x->interval.GetHighPoint(), x->left->max_high, x->right->max_high);
-    x->max_timestamp = max3<uint64_t>(x->interval.GetTimeStamp(), x->left->max_timestamp, x->right->max_timestamp);
+    x->max_high = maxHigh3<TwoDInterval, KeyTraits>(KeyTraits::ref(x->interval->GetHighPoint()), x->left->max_high, x->right->max_high);
+    x->max_timestamp = max3<uint64_t>(x->interval->GetTimeStamp(), x->left->max_timestamp, x->right->max_timestamp);
+    x->min_timestamp = min3<uint64_t>(x->interval->GetTimeStamp(), x->left->min_timestamp, x->right->min_timestamp);
   }
   else {
-    x->max_high = max2<std::string>(x->interval.GetHighPoint(), x->left->max_high);
-    x->max_timestamp = max2<uint64_t>(x->interval.GetTimeStamp(), x->left->max_timestamp);
+    x->max_high = maxHigh2<TwoDInterval, KeyTraits>(KeyTraits::ref(x->interval->GetHighPoint()), x->left->max_high);
+    x->max_timestamp = max2<uint64_t>(x->interval->GetTimeStamp(), x->left->max_timestamp);
+    x->min_timestamp = min2<uint64_t>(x->interval->GetTimeStamp(), x->left->min_timestamp);
   }
 else
   if (x->right != &nil) {
-    x->max_high = max2<std::string>(x->interval.GetHighPoint(), x->right->max_high);
-    x->max_timestamp = max2<uint64_t>(x->interval.GetTimeStamp(), x->right->max_timestamp);
+    x->max_high = maxHigh2<TwoDInterval, KeyTraits>(KeyTraits::ref(x->interval->GetHighPoint()), x->right->max_high);
+    x->max_timestamp = max2<uint64_t>(x->interval->GetTimeStamp(), x->right->max_timestamp);
+    x->min_timestamp = min2<uint64_t>(x->interval->GetTimeStamp(), x->right->min_timestamp);
   }
   else {
-    x->max_high = x->interval.GetHighPoint();
-    x->max_timestamp = x->interval.GetTimeStamp();
+    x->max_high = KeyTraits::ref(x->interval->GetHighPoint());
+    x->max_timestamp = x->interval->GetTimeStamp();
+    x->min_timestamp = x->max_timestamp;
   }
 };
 
 
-//
-void TwoDITwTopK::treeDestroy(TwoDITNode* x) {
 
-if (x->left != &nil)
-  treeDestroy(x->left);
+//
+template <typename Key, typename Compare>
+TopKIteratorT<Key, Compare>::TopKIteratorT(TwoDITwTopK &it, TwoDInterval &ret_int, const Key &min, const Key &max, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) {
 
-if (x->right != &nil)
-  treeDestroy(x->right);
+_it = &it;
+_ret_int = &ret_int;
+current_int = nullptr;
+reader = nullptr;
+iterator_in_use = false;
 
-delete x;
+if(!start(min, max, minTimestamp, maxTimestamp))
+  std::cerr<<std::endl<<"Start failure: Interval tree is empty."<<std::endl;
 };
 
 
 //
-static bool heapCompare(const std::pair<TwoDITNode*, uint64_t> &a, const std::pair<TwoDITNode*, uint64_t> &b) {
+template <typename Key, typename Compare>
+TopKIteratorT<Key, Compare>::TopKIteratorT(TwoDITwTopK &it, const Key &min, const Key &max, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) {
 
-if (a.second < b.second)
-  return true;
+_it = &it;
+_ret_int = nullptr;
+current_int = nullptr;
+reader = nullptr;
+iterator_in_use = false;
 
-return false;
+if(!start(min, max, minTimestamp, maxTimestamp))
+  std::cerr<<std::endl<<"Start failure: Interval tree is empty."<<std::endl;
 };
 
 
 //
-TopKIterator::TopKIterator(TwoDITwTopK &it, TwoDInterval &ret_int, const std::string &min, const std::string &max) {
+template <typename Key, typename Compare>
+TopKIteratorT<Key, Compare>::~TopKIteratorT() {
 
-_it = &it;
-_ret_int = &ret_int;
+stop();
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TopKIteratorT<Key, Compare>::next() {
+
+current_int = nullptr;
+
+if (!iterator_in_use)
+  return false;
+
+bool found;
+
+if (_it->image.isOpen())
+  found = nextImage();
+else if (_it->engine == ENGINE_BTREE)
+  found = nextBTree();
+else
+  found = nextTree();
 
-if(!start(min, max))
-  std::cerr<<std::endl<<"Start failure: Interval tree is either empty or locked by another iterator."<<std::endl;
+// the stored interval stays allocated while the iterator reads its snapshot
+if (found and _ret_int != nullptr)
+  *_ret_int = *current_int;
+
+return found;
 };
 
 
 //
-TopKIterator::~TopKIterator() {
+template <typename Key, typename Compare>
+bool TopKIteratorT<Key, Compare>::nextTree() {
 
-if (iterator_in_use) {
+// intervals come off the heap newest first, see TwoDITwTopKT::treeExpand
+while (!tree_items.empty()) {
+  
+  std::pop_heap(tree_items.begin(), tree_items.end(), heapCompareItem<typename TwoDITwTopK::template SearchItem<const TwoDITNode*> >);
+  typename TwoDITwTopK::template SearchItem<const TwoDITNode*> item = tree_items.back();
+  tree_items.pop_back();
+  
+  if (item.index >= 0) {
+    current_int = item.node->interval;
+    return true;
+  }
   
-  _it->iterator = nullptr;
-  _it->iterator_in_use = false;
+  _it->treeExpand(tree_items, item.node, search_low, search_high, min_timestamp, max_timestamp);
 }
+
+return false;
 };
 
 
 //
-bool TopKIterator::next() {
+template <typename Key, typename Compare>
+bool TopKIteratorT<Key, Compare>::nextImage() {
 
-if (iterator_in_use) {
+// same search as nextTree(), over image node indices
+while (!image_items.empty()) {
   
-  TwoDITNode *x;
-  uint64_t p, t;
+  std::pop_heap(image_items.begin(), image_items.end(), heapCompareItem<typename TwoDITwTopK::template SearchItem<uint32_t> >);
+  typename TwoDITwTopK::template SearchItem<uint32_t> item = image_items.back();
+  image_items.pop_back();
   
-  while (!nodes.empty()) {
-    
-    std::pop_heap(nodes.begin(), nodes.end(), heapCompare);
-    x = nodes.back().first;
-    p = nodes.back().second;
-    nodes.pop_back();
-    
-    if (explored.find(x) == explored.end()) {
-    
-      // branch by exploring children and bound from untenable sub-trees
-      if ((x->left != &(_it->nil)) and (x->left->max_high >= search_int.GetLowPoint())) {
-        
-        nodes.push_back(std::make_pair(x->left, x->left->max_timestamp));
-        std::push_heap(nodes.begin(), nodes.end(), heapCompare);
-      }
-      if ((x->right != &(_it->nil)) and (x->right->max_high >= search_int.GetLowPoint())) {
-        
-        nodes.push_back(std::make_pair(x->right, x->right->max_timestamp));
-        std::push_heap(nodes.begin(), nodes.end(), heapCompare);
-      }
-    }
-    
-    if (x->interval * search_int) { // x intersects query interval
-      
-      t = x->interval.GetTimeStamp();
-      if (t < p) {
-        
-        // reinsert older intersecting interval into heap with correct timestamp
-        nodes.push_back(std::make_pair(x, t));
-        std::push_heap(nodes.begin(), nodes.end(), heapCompare);
-        
-        // mark as explored
-        explored.insert(x);
+  if (item.index >= 0) {
+    _it->imageGetInterval(image_int, item.node);
+    current_int = &image_int;
+    return true;
+  }
+  
+  _it->imageExpand(image_items, item.node, image_min, image_max, min_timestamp, max_timestamp);
+}
 
-      }
-      else {
-        
-        *_ret_int = x->interval;
-        return true;
-      }
-    }
-    
+return false;
+};
+
+
+//
+template <typename Key, typename Compare>
+bool TopKIteratorT<Key, Compare>::nextBTree() {
+
+// intervals come off the heap newest first, see TwoDITwTopKT::btreeExpand
+while (!btree_items.empty()) {
+  
+  std::pop_heap(btree_items.begin(), btree_items.end(), heapCompareItem<typename TwoDITwTopK::template SearchItem<const BTreeNode*> >);
+  typename TwoDITwTopK::template SearchItem<const BTreeNode*> item = btree_items.back();
+  btree_items.pop_back();
+  
+  if (item.index >= 0) {
+    current_int = item.node->first[item.index];
+    return true;
   }
+  
+  _it->btreeExpand(btree_items, item.node, search_low, search_high, min_timestamp, max_timestamp);
 }
 
 return false;
@@ -827,47 +3434,85 @@ return false;
 
 
 //
-void TopKIterator::restart(const std::string &min, const std::string &max) {
+template <typename Key, typename Compare>
+void TopKIteratorT<Key, Compare>::restart(const Key &min, const Key &max, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) {
 
-stop(false);
-start(min, max);
+// a new search, over the tree as it is now
+stop();
+start(min, max, minTimestamp, maxTimestamp);
 };
 
 
 //
-void TopKIterator::stop(const bool &release) {
+template <typename Key, typename Compare>
+void TopKIteratorT<Key, Compare>::stop() {
+
+current_int = nullptr;
 
 if (iterator_in_use) {
   
-  if (release) {
-    _it->iterator = nullptr;
-    _it->iterator_in_use = false;
-  }
+  tree_items.clear();
+  image_items.clear();
+  btree_items.clear();
   
-  nodes.clear();
-  explored.clear();
+  _it->readEnd(reader);
   iterator_in_use = false;
 }
 };
 
 
 //
-bool TopKIterator::start(const std::string &min, const std::string &max) {
+template <typename Key, typename Compare>
+bool TopKIteratorT<Key, Compare>::start(const Key &min, const Key &max, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) {
 
-if (_it->root != &(_it->nil) and !(_it->iterator_in_use)) {
-  
-  _it->iterator_in_use = true;
-  _it->iterator = this;
-  
-  search_int = TwoDInterval("", min, max, 0);
-  iterator_in_use = true;
-  
-  nodes.push_back(std::make_pair(_it->root, _it->root->max_timestamp));
-  
-  return true;
+bool empty;
+
+// the search reads the published snapshot, which writers replace rather than change
+snapshot = _it->readBegin(reader);
+
+if (_it->image.isOpen())
+  empty = (_it->image.size() == 0);
+else if (_it->engine == ENGINE_BTREE)
+  empty = (snapshot->btree_root == nullptr);
+else
+  empty = (snapshot->root == &(_it->nil));
+
+if (empty) {
+  _it->readEnd(reader);
+  return false;
 }
 
-return false;
+search_int = TwoDInterval(TwoDITId(), min, max, 0);
+search_low = KeyTraits::ref(search_int.GetLowPoint());
+search_high = KeyTraits::ref(search_int.GetHighPoint());
+min_timestamp = minTimestamp;
+max_timestamp = maxTimestamp;
+iterator_in_use = true;
+
+if (_it->image.isOpen()) {
+  std::string buf;
+  image_min = KeyTraits::encode(min, buf);
+  image_max = KeyTraits::encode(max, buf);
+  _it->imagePush(image_items, _it->image.root(), image_min, image_max, min_timestamp, max_timestamp);
+}
+else if (_it->engine == ENGINE_BTREE) {
+  // the root comes off the heap first whatever its priority
+  typename TwoDITwTopK::template SearchItem<const BTreeNode*> item = {snapshot->btree_root, -1, 0};
+  btree_items.push_back(item);
+}
+else
+  _it->treePush(tree_items, snapshot->root, search_low, search_high, min_timestamp, max_timestamp);
+
+return true;
 };
 
 
+// the key types built into the library
+template class TwoDITwTopKT<std::string>;
+template class TopKIteratorT<std::string>;
+template class TwoDITwTopKT<uint64_t>;
+template class TopKIteratorT<uint64_t>;
+template class TwoDITwTopKT<int64_t>;
+template class TopKIteratorT<int64_t>;
+template class TwoDITwTopKT<double>;
+template class TopKIteratorT<double>;
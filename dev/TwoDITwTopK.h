@@ -1,88 +1,401 @@
 #ifndef TWOD_IT_W_TOPK_H
 #define TWOD_IT_W_TOPK_H
 
+#include "TwoDITBTree.h"
+#include "TwoDITHashMap.h"
+#include "TwoDITImage.h"
+#include "TwoDITPool.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <inttypes.h>
+#include <iosfwd>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 
 
-class TwoDITNode;
-class TopKIterator;
+template <typename Key, typename Compare> class TopKIteratorT;
+
+// when appended log records are forced to disk in log mode; each is written to the log
+// as it is appended, so whatever the policy a crash of the process alone loses none
+enum TwoDITFsyncPolicy {
+  FSYNC_PER_OP,       // every insert/delete is durable on return
+  FSYNC_PER_N_OPS,    // group commit every N operations
+  FSYNC_PER_INTERVAL, // group commit at most N milliseconds after a write, idle or not
+  FSYNC_NONE          // leave flushing to the OS
+};
+
+// index structure behind a store, chosen when it is constructed
+enum TwoDITEngine {
+  ENGINE_RBTREE,      // augmented red-black tree, one interval per node
+  ENGINE_BTREE        // augmented B+-tree, 16 intervals or child summaries per node
+};
+
+// interval id: a file number and, for intervals that cover one block of the file, the
+// block number. The string form is "file" or "file<delim>block".
+struct TwoDITId {
+  static const uint64_t kNone = 0xFFFFFFFFFFFFFFFFULL;
+  
+  TwoDITId() : file(kNone), block(kNone) {};
+  explicit TwoDITId(const uint64_t &file, const uint64_t &block = kNone) : file(file), block(block) {};
+  
+  bool empty() const {return file == kNone;};
+  bool hasBlock() const {return block != kNone;};
+  
+  bool operator == (const TwoDITId &other) const {return file == other.file and block == other.block;};
+  bool operator != (const TwoDITId &other) const {return !(*this == other);};
+  bool operator < (const TwoDITId &other) const {return file < other.file or (file == other.file and block < other.block);};
+  
+  std::string str(const char &delim = '+') const;
+  static bool parse(TwoDITId &id, const std::string &s, const char &delim = '+');
+  
+  uint64_t file, block;
+};
+
+struct TwoDITIdHash {
+  size_t operator()(const TwoDITId &id) const {
+    uint64_t h = id.file * 0x9E3779B97F4A7C15ULL;
+    h ^= id.block + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    return h;
+  };
+};
+
+std::ostream& operator << (std::ostream &os, const TwoDITId &id);
+
+// one file's share of a query's results: its overlapping block numbers, ascending so they can be
+// read in one pass, and the newest timestamp among them
+struct TwoDITFileHits {
+  uint64_t file;
+  uint64_t timestamp;
+  std::vector<uint64_t> blocks; // an interval naming the whole file adds none
+};
+
+
+// a reader's claim on a store: while version is non-zero, nothing a writer dropped in a later
+// version is freed. Records are never freed before the store, a released one is reused.
+struct TwoDITReader {
+  std::atomic<bool> claimed;
+  std::atomic<uint64_t> version;
+  TwoDITReader *next;
+  char padding[128 - sizeof(std::atomic<uint64_t>) - 2 * sizeof(void*)]; // a cache line of its own
+};
+
+
+// how keys are written to sync files, logs and images: an encoding whose byte order matches
+// std::less, plus how a node refers to its sub-tree's largest high point. Numeric keys are
+// kept by value, other keys by pointer into the owning interval.
+template <typename Key>
+struct TwoDITKeyTraits;
+
+// string key reference carrying the key's first 8 bytes, big-endian and zero-padded; in
+// byte order, differing prefixes order the keys without reading either string
+struct TwoDITStringRef {
+  uint64_t prefix;
+  const std::string *key;
+  
+  bool operator == (const TwoDITStringRef &other) const {return key == other.key;};
+};
+
+template <>
+struct TwoDITKeyTraits<std::string> {
+  typedef TwoDITStringRef Ref;
+  static const bool kPrefixed = true;
+  static Ref ref(const std::string &k) {
+    Ref r = {0, &k};
+    for (size_t i = 0; i < 8; i++) r.prefix = (r.prefix << 8) | (i < k.size() ? (unsigned char)k[i] : 0);
+    return r;
+    };
+  static uint64_t prefix(const Ref &r) {return r.prefix;};
+  static const std::string &deref(const Ref &r) {return *r.key;};
+  static const std::string &encode(const std::string &k, std::string &) {return k;};
+  static std::string decode(const std::string &s) {return s;};
+};
+
+template <>
+struct TwoDITKeyTraits<uint64_t> {
+  typedef uint64_t Ref;
+  static const bool kPrefixed = false;
+  static Ref ref(const uint64_t &k) {return k;};
+  static uint64_t prefix(const Ref &) {return 0;};
+  static const uint64_t &deref(const Ref &r) {return r;};
+  static const std::string &encode(const uint64_t &k, std::string &buf) {
+    buf.resize(8);
+    for (int i = 0; i < 8; i++) buf[i] = (char)(k >> (56 - 8 * i));
+    return buf;
+    };
+  static uint64_t decode(const std::string &s) {
+    if (s.size() != 8) throw std::runtime_error("Corrupt numeric key");
+    uint64_t k = 0;
+    for (int i = 0; i < 8; i++) k = (k << 8) | (unsigned char)s[i];
+    return k;
+    };
+};
+
+template <>
+struct TwoDITKeyTraits<int64_t> {
+  typedef int64_t Ref;
+  static const bool kPrefixed = false;
+  static Ref ref(const int64_t &k) {return k;};
+  static uint64_t prefix(const Ref &) {return 0;};
+  static const int64_t &deref(const Ref &r) {return r;};
+  // flipping the sign bit orders negatives before positives
+  static const std::string &encode(const int64_t &k, std::string &buf) {
+    return TwoDITKeyTraits<uint64_t>::encode((uint64_t)k ^ (1ULL << 63), buf);
+    };
+  static int64_t decode(const std::string &s) {
+    return (int64_t)(TwoDITKeyTraits<uint64_t>::decode(s) ^ (1ULL << 63));
+    };
+};
+
+template <>
+struct TwoDITKeyTraits<double> {
+  typedef double Ref;
+  static const bool kPrefixed = false;
+  static Ref ref(const double &k) {return k;};
+  static uint64_t prefix(const Ref &) {return 0;};
+  static const double &deref(const Ref &r) {return r;};
+  // negatives have all bits flipped, positives just the sign bit; -0.0 is stored as 0.0
+  static const std::string &encode(const double &k, std::string &buf) {
+    double d = (k == 0) ? 0.0 : k;
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    bits = (bits >> 63) ? ~bits : (bits | (1ULL << 63));
+    return TwoDITKeyTraits<uint64_t>::encode(bits, buf);
+    };
+  static double decode(const std::string &s) {
+    uint64_t bits = TwoDITKeyTraits<uint64_t>::decode(s);
+    bits = (bits >> 63) ? (bits & ~(1ULL << 63)) : ~bits;
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+    };
+};
+
 
 // 1d-interval in interval_dimension-time space
-class TwoDInterval {
+template <typename Key, typename Compare = std::less<Key> >
+class TwoDIntervalT {
 public:
-  TwoDInterval() {};
-  TwoDInterval(const std::string &id, const std::string &low, const std::string &high, const uint64_t &timestamp) :
+  TwoDIntervalT() : _low(), _high(), _timestamp(0) {};
+  TwoDIntervalT(const TwoDITId &id, const Key &low, const Key &high, const uint64_t &timestamp) :
     _id(id), _low(low), _high(high), _timestamp(timestamp) {};
   
-  std::string GetId() const {return _id;};
-  std::string GetLowPoint() const {return _low;};
-  std::string GetHighPoint() const {return _high;};
+  const TwoDITId &GetId() const {return _id;};
+  const Key &GetLowPoint() const {return _low;};
+  const Key &GetHighPoint() const {return _high;};
   uint64_t GetTimeStamp() const {return _timestamp;};
   
-  bool operator == (const TwoDInterval& otherInterval)
+  bool operator == (const TwoDIntervalT& otherInterval)
     const {return (_id == otherInterval._id);}
-  bool operator > (const TwoDInterval& otherInterval)
+  bool operator > (const TwoDIntervalT& otherInterval)
     const {return (_timestamp > otherInterval._timestamp);}
   
   // overlap operator
-  bool operator * (const TwoDInterval& otherInterval) const {
+  bool operator * (const TwoDIntervalT& otherInterval) const {
     // point intersections are considered intersections
-    if (_low < otherInterval._low) return (_high >= otherInterval._low);
-    return (otherInterval._high >= _low);
+    if (lower(_low, otherInterval._low)) return !lower(_high, otherInterval._low);
+    return !lower(otherInterval._high, _low);
     }
+  
+  static bool lower(const Key &a, const Key &b) {return Compare()(a, b);};
+  
+  // the same on key references; in the default order differing prefixes settle it
+  static bool lowerRef(const typename TwoDITKeyTraits<Key>::Ref &a, const typename TwoDITKeyTraits<Key>::Ref &b) {
+    typedef TwoDITKeyTraits<Key> KeyTraits;
+    if (KeyTraits::kPrefixed and std::is_same<Compare, std::less<Key> >::value and KeyTraits::prefix(a) != KeyTraits::prefix(b))
+      return KeyTraits::prefix(a) < KeyTraits::prefix(b);
+    return lower(KeyTraits::deref(a), KeyTraits::deref(b));
+    };
 
 protected:
-  std::string _id;
-  std::string _low;
-  std::string _high;
+  TwoDITId _id;
+  Key _low;
+  Key _high;
   uint64_t _timestamp;
 };
 
 
-// Interval tree node
-class TwoDITNode {
+// Inserts and deletes to apply in one go, in the order added. A store applies a batch as one
+// write: queries and iterators see all of it or none, and in log mode it is one log record.
+template <typename Key>
+class TwoDITWriteBatchT {
+public:
+  enum Type {INSERT, DELETE, DELETE_FILE};
+  
+  struct Op {
+    Type type;
+    TwoDITId id; // the file alone for DELETE_FILE
+    Key low, high;
+    uint64_t timestamp;
+  };
+  
+  void insertInterval(const TwoDITId &id, const Key &minKey, const Key &maxKey, const uint64_t &maxTimestamp) {
+    Op op = {INSERT, id, minKey, maxKey, maxTimestamp};
+    ops.push_back(op);
+    };
+  void deleteInterval(const TwoDITId &id) {
+    Op op = {DELETE, id, Key(), Key(), 0};
+    ops.push_back(op);
+    };
+  void deleteAllIntervals(const uint64_t &file) {
+    Op op = {DELETE_FILE, TwoDITId(file), Key(), Key(), 0};
+    ops.push_back(op);
+    };
+  
+  void clear() {ops.clear();};
+  size_t size() const {return ops.size();};
+  const std::vector<Op> &operations() const {return ops;};
+
+private:
+  std::vector<Op> ops;
+};
+
+
+// Interval tree node, shared with published snapshots until a writer copies it
+template <typename Key, typename Compare = std::less<Key> >
+class TwoDITNodeT {
 public:
-  TwoDITNode() : is_red(false) {};
+  TwoDITNodeT() : interval(nullptr), low(), high(), is_red(false), max_high(), min_low(), version(0) {};
 
-  TwoDInterval interval;
+  const TwoDIntervalT<Key, Compare> *interval;
+  typename TwoDITKeyTraits<Key>::Ref low, high; // the interval's keys, so descents need not read it
   bool is_red;
-  std::string max_high;
-  uint64_t max_timestamp;
-  TwoDITNode *left, *right, *parent;
+  typename TwoDITKeyTraits<Key>::Ref max_high; // high point of the sub-tree's largest interval
+  typename TwoDITKeyTraits<Key>::Ref min_low; // low point of the sub-tree's leftmost interval
+  uint64_t max_timestamp, min_timestamp; // newest and oldest timestamp in the sub-tree
+  uint64_t version; // write version the node was created in
+  TwoDITNodeT *left, *right;
 };
 
 
-// Storage and index for intervals
-class TwoDITwTopK {
+// Storage and index for intervals. One writer at a time is let in by a mutex; queries,
+// getInterval and iterators take no lock, they read the tree as last published by a writer.
+template <typename Key, typename Compare = std::less<Key> >
+class TwoDITwTopKT {
 public:
-  TwoDITwTopK();
-  TwoDITwTopK(const std::string &filename, const bool &sync_from_file);
-  ~TwoDITwTopK();
+  typedef TwoDIntervalT<Key, Compare> TwoDInterval;
+  typedef TwoDITNodeT<Key, Compare> TwoDITNode;
+  typedef TopKIteratorT<Key, Compare> TopKIterator;
+  typedef TwoDITKeyTraits<Key> KeyTraits;
+  typedef TwoDITWriteBatchT<Key> WriteBatch;
+  typedef TwoDITBTreeT<TwoDInterval, KeyTraits> BTree;
+  typedef typename BTree::Node BTreeNode;
+  typedef std::function<bool(const TwoDInterval&)> Visitor;
+  typedef std::function<bool(const TwoDInterval&, const size_t&)> BatchVisitor;
+  
+  explicit TwoDITwTopKT(const TwoDITEngine &engine = ENGINE_RBTREE);
+  TwoDITwTopKT(const std::string &filename, const bool &sync_from_file, const TwoDITEngine &engine = ENGINE_RBTREE);
+  ~TwoDITwTopKT();
 
-  void insertInterval(const std::string &id, const std::string &minKey, const std::string &maxKey, const uint64_t &maxTimestamp);
+  void insertInterval(const TwoDITId &id, const Key &minKey, const Key &maxKey, const uint64_t &maxTimestamp);
+  void bulkInsert(const std::vector<TwoDInterval> &intervals);
+  
+  void deleteInterval(const TwoDITId &id);
+  void deleteAllIntervals(const uint64_t &file);
+  
+  void getInterval(TwoDInterval &ret_interval, const TwoDITId &id) const;
+  
+  // every write of the batch under one publish and one durability event; a batch touching a
+  // large share of the store rebuilds the tree once instead of changing it write by write
+  void applyBatch(const WriteBatch &batch);
+  
+  // the number of intervals stored, and the lowest low and highest high point among them;
+  // getKeyRange is false on an empty store
+  void getSize(uint64_t &size) const;
+  bool getKeyRange(Key &minKey, Key &maxKey) const;
   
+  // "file<delim>block" string ids, parsed with the store's id delimiter
+  void insertInterval(const std::string &id, const Key &minKey, const Key &maxKey, const uint64_t &maxTimestamp);
   void deleteInterval(const std::string &id);
   void deleteAllIntervals(const std::string &id_prefix);
-  
   void getInterval(TwoDInterval &ret_interval, const std::string &id) const;
-  void topK(std::vector<TwoDInterval> &ret_value, const std::string &minKey, const std::string &maxKey);
+  void topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey) const;
+  void topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k) const;
+  
+  // only intervals with minTimestamp <= timestamp <= maxTimestamp, e.g. those visible at a
+  // snapshot or written since a sequence number
+  void topK(std::vector<TwoDInterval> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+  
+  // calls visit on each interval overlapping [minKey, maxKey], in low point order, until it returns false
+  void visitOverlaps(const Key &minKey, const Key &maxKey, const Visitor &visit) const;
+  
+  // one walk for many [low, high] ranges: visit gets each overlap with the index of every range it
+  // falls in; with threads > 1 the ranges are split by key space and visit must be thread-safe
+  void visitOverlaps(const std::vector<std::pair<Key, Key> > &ranges, const BatchVisitor &visit, const unsigned &threads = 1) const;
+  void topK(std::vector<std::vector<TwoDInterval> > &ret_values, const std::vector<std::pair<Key, Key> > &ranges) const;
+  
+  // the same results grouped by file, files newest first
+  void topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey) const;
+  void topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k) const;
+  void topKByFile(std::vector<TwoDITFileHits> &ret_value, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+  
+  // groups by file the intervals fill passes to its visitor, in any order; for indexes built on stores
+  static void groupByFile(std::vector<TwoDITFileHits> &ret_value, const std::function<void(const Visitor&)> &fill);
   
   void sync() const;
+  void waitForSync() const;
+  void getSyncPoint(uint64_t &synced, uint64_t &current) const;
 
+  // an empty name turns snapshots and the log off, for a store that is rebuilt, not reloaded
   void setSyncFile(const std::string &filename);
   void getSyncFile(std::string &filename) const;
   void setSyncThreshold(const uint32_t &threshold);
   void getSyncThreshold(uint32_t &threshold) const;
   
+  // in log mode a write is logged before readers can see it; one whose record cannot be
+  // written is refused, and a log that cannot be repaired turns log mode off
+  void setLogMode(const bool &enable);
+  void getLogMode(bool &enable) const;
+  void setBackgroundSync(const bool &enable);
+  void getBackgroundSync(bool &enable) const;
+  void setFsyncPolicy(const TwoDITFsyncPolicy &policy, const uint32_t &n);
+  void getFsyncPolicy(TwoDITFsyncPolicy &policy, uint32_t &n) const;
+  void flushLog() const;
+  
   void setIdDelimiter(const char &delim);
   void getIdDelimiter(char &delim) const;
+  void getEngine(TwoDITEngine &engine) const;
+  
+  bool exportImage(const std::string &filename) const;
+  
+  // like the destructor, not to be called while other threads may be reading the store
+  bool openImage(const std::string &filename);
+  
+  // keeps what the calling thread reads from the store, over any number of calls, from being
+  // freed until the guard goes; the calls share its announcement
+  class ReadGuard {
+  public:
+    explicit ReadGuard(const TwoDITwTopKT &store) : store(store) {store.readEnter();};
+    ~ReadGuard() {store.readExit();};
+  
+  private:
+    ReadGuard(const ReadGuard&);
+    ReadGuard& operator=(const ReadGuard&);
+    
+    const TwoDITwTopKT &store;
+    mutable std::deque<TwoDInterval> decoded; // image intervals handed out under the guard
+    
+    friend class TwoDITwTopKT;
+  };
+  
+  // topK without copies: pointers to the stored intervals, valid while guard is held. An open
+  // image stores none, so its results are decoded into the guard instead
+  void topK(std::vector<const TwoDInterval*> &ret_value, const ReadGuard &guard, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp = 0, const uint64_t &maxTimestamp = UINT64_MAX) const;
+  
+  // for structures kept beside the store and read under its guard: release runs once every
+  // read begun before the call is over, so it may free what the caller has just unlinked
+  void retire(const std::function<void()> &release);
 
   void storagePrint() const;
   void treePrintLevelOrder() const;
@@ -91,63 +404,225 @@ public:
   
 private:
   
+  // a range of a batch query, sorted by low; reach is the largest high of it and the ranges before it
+  template <typename Bound>
+  struct BatchRange {
+    Bound low, high, reach;
+    size_t index;
+  };
+  
+  // best-first search entry: a node to expand or, with an index, one of its intervals
+  template <typename Node>
+  struct SearchItem {
+    Node node;
+    int index;
+    uint64_t priority;
+  };
+  
+  // the roots as of a version; nothing reachable from them is freed while a reader that
+  // announced the version, or an earlier one, is still reading
+  struct Snapshot {
+    const TwoDITNode *root;
+    const BTreeNode *btree_root;
+    uint64_t version;
+    uint64_t size;
+  };
+  
+  // a query's read of the published snapshot, announced in its thread's record for the
+  // scope's lifetime
+  struct ReadScope {
+    explicit ReadScope(const TwoDITwTopKT &store) : store(store), snapshot(store.readEnter()) {};
+    ~ReadScope() {store.readExit();};
+    
+    const TwoDITwTopKT &store;
+    const Snapshot *snapshot;
+  };
+  
   void setDefaults();
+  TwoDITReader* readerClaim() const;
+  const Snapshot* readBegin(TwoDITReader* &reader) const;
+  void readEnd(TwoDITReader* &reader) const;
+  const Snapshot* readEnter() const;
+  void readExit() const;
+  void publish();
+  void reclaim();
+  void syncLoad(const std::string &filename);
+  void syncCheck(const uint32_t &ops);
+  bool syncWrite(const TwoDITNode* x, const BTreeNode* b, const std::string &filename) const;
+  void syncStart();
+  void syncBackground(const TwoDITNode* x, const BTreeNode* b, const std::string filename, const uint64_t sequence);
+  void syncReclaim();
+  void logOpen();
+  void logClose();
+  void flushStart();
+  void flushStop();
+  void flushBackground();
+  bool logAppend(const std::string &record);
+  void logReplay(const std::string &filename);
+  void applyInsert(const TwoDITId &id, const Key &minKey, const Key &maxKey, const uint64_t &maxTimestamp);
+  const TwoDInterval* bulkNode(const TwoDITId &id, const Key &minKey, const Key &maxKey, const uint64_t &maxTimestamp, std::unordered_set<const TwoDInterval*> &replaced);
+  void bulkBuild(std::vector<const TwoDInterval*> &intervals, const std::unordered_set<const TwoDInterval*> &replaced, const bool &sorted);
+  bool applyDelete(const TwoDITId &id);
+  void applyWrites(const std::vector<typename WriteBatch::Op> &ops);
+  uint32_t applyDeleteAll(const uint64_t &file);
+  void fileAdd(const TwoDITId &id);
+  void fileRemove(const TwoDITId &id);
   
   void treePrintInOrderRecursive(TwoDITNode* x, const int &depth) const;
   int treeHeightRecursive(TwoDITNode* x) const;
-  bool treeIntervalSearch(const TwoDInterval &test_interval, std::unordered_set<TwoDITNode*> &found, TwoDITNode* &x) const;
+  void indexInOrder(const TwoDITNode* x, const BTreeNode* b, std::vector<const TwoDInterval*> &intervals) const;
+  void indexDrain(std::vector<const TwoDInterval*> &intervals);
+  void indexBuild(const std::vector<const TwoDInterval*> &intervals);
+  void treeInOrder(const TwoDITNode* x, std::vector<const TwoDInterval*> &intervals) const;
+  bool treeVisit(const TwoDITNode* x, const typename KeyTraits::Ref &low, const typename KeyTraits::Ref &high, const Visitor &visit) const;
+  bool imageVisit(const uint32_t &x, const std::string &minKey, const std::string &maxKey, const Visitor &visit) const;
+  bool treeVisitBatch(const TwoDITNode* x, const std::vector<BatchRange<typename KeyTraits::Ref> > &ranges, const size_t &begin, const size_t &end, const BatchVisitor &visit) const;
+  bool btreeVisitBatch(const BTreeNode* x, const std::vector<BatchRange<typename KeyTraits::Ref> > &ranges, const size_t &begin, const size_t &end, const BatchVisitor &visit) const;
+  bool imageVisitBatch(const uint32_t &x, const std::vector<BatchRange<std::string> > &ranges, const size_t &begin, const size_t &end, const BatchVisitor &visit) const;
+  void imageGetInterval(TwoDInterval &ret_interval, const uint32_t &x) const;
+  void indexTopK(std::vector<const TwoDInterval*> &ret_value, const Snapshot* snapshot, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+  void treeTopK(std::vector<const TwoDInterval*> &ret_value, const TwoDITNode* x, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+  void treePush(std::vector<SearchItem<const TwoDITNode*> > &heap, const TwoDITNode* x, const typename KeyTraits::Ref &low, const typename KeyTraits::Ref &high, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+  void treeExpand(std::vector<SearchItem<const TwoDITNode*> > &heap, const TwoDITNode* x, const typename KeyTraits::Ref &low, const typename KeyTraits::Ref &high, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+  void btreeTopK(std::vector<const TwoDInterval*> &ret_value, const BTreeNode* x, const Key &minKey, const Key &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+  void btreeExpand(std::vector<SearchItem<const BTreeNode*> > &heap, const BTreeNode* x, const typename KeyTraits::Ref &low, const typename KeyTraits::Ref &high, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+  void imageTopK(std::vector<TwoDInterval> &ret_value, const std::string &minKey, const std::string &maxKey, const uint32_t &k, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+  void imagePush(std::vector<SearchItem<uint32_t> > &heap, const uint32_t &x, const std::string &minKey, const std::string &maxKey, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+  void imageExpand(std::vector<SearchItem<uint32_t> > &heap, const uint32_t &x, const std::string &minKey, const std::string &maxKey, const uint64_t &minTimestamp, const uint64_t &maxTimestamp) const;
+  TwoDITNode* treeBuild(const std::vector<const TwoDInterval*> &intervals, const size_t &lo, const size_t &hi, const int &depth, const int &red_depth);
   void treeInsert(TwoDITNode* z);
-  void treeInsertFixup(TwoDITNode* z);
-  void treeDelete(TwoDITNode* z);
-  void treeDeleteFixup(TwoDITNode* x);
-  TwoDITNode* treeMinimum(TwoDITNode* x) const;
-  TwoDITNode* treeSuccessor(TwoDITNode* x) const;
-  void treeLeftRotate(TwoDITNode* x);
-  void treeRightRotate(TwoDITNode* x);
-  void treeTransplant(TwoDITNode* u, TwoDITNode* v);
-  void treeMaxFieldsFixup(TwoDITNode* x);
+  void treeInsertFixup();
+  void treeDelete(const TwoDInterval* interval);
+  void treeDeleteFixup(bool x_left);
+  TwoDITNode** treeLink(const size_t &i);
+  TwoDITNode* treeWritable(TwoDITNode** link);
+  void treeRetire(TwoDITNode* x);
+  void intervalRetire(const TwoDInterval* interval);
+  void treeLeftRotate(TwoDITNode** link);
+  void treeRightRotate(TwoDITNode** link);
+  void treeMaxFieldsFixup(const size_t &z_index);
   void treeSetMaxFields(TwoDITNode* x);
-  void treeDestroy(TwoDITNode* x);
   
   TwoDITNode *root, nil;
-  std::unordered_map<std::string, TwoDITNode*> storage;
+  TwoDITHashMap<TwoDITId, TwoDInterval, TwoDITIdHash> storage;
+  
+  // nodes from the root to the one being inserted or deleted, standing in for parent pointers
+  std::vector<TwoDITNode*> path;
+  
+  // every write ends by publishing its tree as a new snapshot and freezing it, so nodes with a
+  // version up to frozen_version are copied before writing; what a writer drops waits, with
+  // the version that dropped it, until no reader has announced an older version
+  mutable std::recursive_mutex write_mutex;
+  uint64_t write_version, frozen_version;
+  std::atomic<const Snapshot*> published;
+  std::atomic<uint64_t> published_version;
+  mutable std::atomic<TwoDITReader*> readers;
+  uint64_t store_id; // finds this store's record among a thread's, never reused
+  std::deque<std::pair<uint64_t, TwoDITNode*> > retired_nodes;
+  std::deque<std::pair<uint64_t, const TwoDInterval*> > retired_intervals;
+  std::deque<std::pair<uint64_t, const Snapshot*> > retired_snapshots;
+  std::deque<std::pair<uint64_t, std::function<void()> > > retired_releases;
+  
+  // nodes, intervals and snapshots come from slabs owned by the store
+  TwoDITPool<TwoDITNode> node_pool;
+  TwoDITPool<TwoDInterval> interval_pool;
+  TwoDITPool<Snapshot> snapshot_pool;
   
-  std::unordered_map<std::string, std::unordered_set<std::string> > ids;
-  char id_delim;
+  // with ENGINE_BTREE the intervals are indexed here and the red-black tree stays empty
+  TwoDITEngine engine;
+  BTree btree;
+  
+  // each file's block numbers, in order; blocks mostly arrive in order, so adding is an append
+  std::unordered_map<uint64_t, std::vector<uint64_t> > files;
+  std::atomic<char> id_delim;
   
   std::string sync_file;
   uint32_t sync_threshold;
   mutable uint32_t sync_counter;
   
-  bool iterator_in_use;
-  TopKIterator *iterator;
+  bool background_sync;
+  TwoDITReader *sync_reader; // held while the background sync reads a snapshot
+  mutable std::thread sync_thread;
+  std::atomic<bool> sync_running;
+  uint64_t write_sequence;
+  mutable std::atomic<uint64_t> synced_sequence;
+  
+  bool log_mode;
+  int log_fd;
+  TwoDITFsyncPolicy fsync_policy;
+  uint32_t fsync_n;
+  mutable std::string log_buffer; // the record being written, kept for its allocation
+  mutable uint64_t log_size;        // bytes of whole records in the log
+  mutable uint32_t log_unsynced;
+  mutable std::chrono::steady_clock::time_point log_last_fsync;
+  
+  // under FSYNC_PER_INTERVAL, commits what writes left once they stop
+  std::thread flush_thread;
+  std::mutex flush_mutex;
+  std::condition_variable flush_wake;
+  bool flush_stop;
+  
+  // when open, queries run on the mapped image and the store is read-only
+  TwoDITImage image;
   
-friend class TopKIterator;
+friend class TopKIteratorT<Key, Compare>;
 };
 
 
-class TopKIterator {
+template <typename Key, typename Compare = std::less<Key> >
+class TopKIteratorT {
 public:
+  typedef TwoDIntervalT<Key, Compare> TwoDInterval;
+  typedef TwoDITNodeT<Key, Compare> TwoDITNode;
+  typedef TwoDITwTopKT<Key, Compare> TwoDITwTopK;
+  typedef TwoDITKeyTraits<Key> KeyTraits;
+  typedef typename TwoDITwTopK::BTreeNode BTreeNode;
   
-  TopKIterator(TwoDITwTopK &it, TwoDInterval &ret_int, const std::string &min, const std::string &max);
-  ~TopKIterator();
+  TopKIteratorT(TwoDITwTopK &it, TwoDInterval &ret_int, const Key &min, const Key &max, const uint64_t &minTimestamp = 0, const uint64_t &maxTimestamp = UINT64_MAX);
+  
+  // copies nothing; each result is read through current()
+  TopKIteratorT(TwoDITwTopK &it, const Key &min, const Key &max, const uint64_t &minTimestamp = 0, const uint64_t &maxTimestamp = UINT64_MAX);
+  ~TopKIteratorT();
   
   bool next();
-  void restart(const std::string &min, const std::string &max);
-  void stop(const bool &release=true);
+  
+  // the interval next() found, valid until the following next(), restart() or stop()
+  const TwoDInterval* current() const {return current_int;};
+  void restart(const Key &min, const Key &max, const uint64_t &minTimestamp = 0, const uint64_t &maxTimestamp = UINT64_MAX);
+  void stop();
 
 private:
   
-  bool start(const std::string &min, const std::string &max);
+  bool start(const Key &min, const Key &max, const uint64_t &minTimestamp, const uint64_t &maxTimestamp);
+  bool nextTree();
+  bool nextImage();
+  bool nextBTree();
   
   TwoDITwTopK *_it;
   TwoDInterval *_ret_int, search_int;
+  const TwoDInterval *current_int;
+  TwoDInterval image_int; // an image's intervals are decoded here
+  typename KeyTraits::Ref search_low, search_high; // search_int's keys, compared against the nodes'
+  std::string image_min, image_max; // search bounds in the image's key encoding
+  uint64_t min_timestamp, max_timestamp; // timestamp window of the search
   
+  // the version of the tree the search reads, announced in reader while iterator_in_use
+  const typename TwoDITwTopK::Snapshot *snapshot;
+  TwoDITReader *reader;
   bool iterator_in_use;
-  std::vector<std::pair<TwoDITNode*, uint64_t>> nodes;
-  std::unordered_set<TwoDITNode*> explored;
+  std::vector<typename TwoDITwTopK::template SearchItem<const TwoDITNode*> > tree_items;
+  std::vector<typename TwoDITwTopK::template SearchItem<uint32_t> > image_items;
+  std::vector<typename TwoDITwTopK::template SearchItem<const BTreeNode*> > btree_items;
 
 };
 
 
+// the original string-keyed store; uint64_t, int64_t and double keys are also built in
+typedef TwoDIntervalT<std::string> TwoDInterval;
+typedef TwoDITNodeT<std::string> TwoDITNode;
+typedef TwoDITwTopKT<std::string> TwoDITwTopK;
+typedef TopKIteratorT<std::string> TopKIterator;
+typedef TwoDITWriteBatchT<std::string> TwoDITWriteBatch;
+
+
 #endif
@@ -44,7 +44,7 @@ a.treePrintLevelOrder();
 // Call top-k
 std::cout<<std::endl<<"> Top-5 intervals that overlap with (n,o) in A:"<<std::endl;
 TwoDInterval r;
-TopKIterator it(a, r, "n", "o"); // Locks a for inserts, deletes and iteration by other iterators
+TopKIterator it(a, r, "n", "o"); // Reads a snapshot of a; inserts, deletes and other iterators go ahead
 
 // Top 2 intervals:
 int index = 0;
@@ -54,7 +54,7 @@ while(it.next()) {
     break;
 }
 
-// Here a is still locked 
+// Here it still reads a as it was when it started
 
 // Rest of the top 5 intervals:
 while(it.next()) {
@@ -63,7 +63,7 @@ while(it.next()) {
     break;
 }
 
-// Insert releases a for inserts, deletes and iteration by other iterators
+// Inserts do not disturb it; it keeps its snapshot until restarted or stopped
 std::cout<<std::endl<<"> Inserting interval (0+3, e, z, 32) into A:"<<std::endl;
 a.insertInterval("0+3", "e", "z", 32);
 
@@ -76,7 +76,7 @@ std::cout<<std::endl<<"> All top intervals that overlap with (h,p) in A:"<<std::
 it.restart("h","p");
 while(it.next())
   std::cout<<"("<<r.GetId()<<", "<<r.GetLowPoint()<<", "<<r.GetHighPoint()<<", "<<r.GetTimeStamp()<<")"<<std::endl;
-it.stop(); //release a
+it.stop(); //release its snapshot of a
 
 // Delete interval (id)
 std::cout<<std::endl<<"> Deleting interval with id 4 (i.e. (n,w)) in A."<<std::endl;
@@ -91,7 +91,7 @@ std::cout<<std::endl<<"> All top intervals that overlap with (m,o) in A:"<<std::
 it.restart("m","o");
 while(it.next())
   std::cout<<"("<<r.GetId()<<", "<<r.GetLowPoint()<<", "<<r.GetHighPoint()<<", "<<r.GetTimeStamp()<<")"<<std::endl;
-it.stop(); //release a
+it.stop(); //release its snapshot of a
 
 // Delete all intervals with common prefix (id_prefix)
 std::cout<<std::endl<<"> Deleting all intervals with ids starting with 0 (i.e. (b,n) and (c,o)) in A."<<std::endl;
@@ -106,7 +106,7 @@ std::cout<<std::endl<<"> All top intervals that overlap with (m,o) in A:"<<std::
 it.restart("m","o");
 while(it.next())
   std::cout<<"("<<r.GetId()<<", "<<r.GetLowPoint()<<", "<<r.GetHighPoint()<<", "<<r.GetTimeStamp()<<")"<<std::endl;
-it.stop(); //release a
+it.stop(); //release its snapshot of a
 
 std::cout<<std::endl;
 
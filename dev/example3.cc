@@ -5,17 +5,22 @@
 #include <cstdlib>
 #include <ctime>
 #include <fstream>
+#include <algorithm>
+#include <vector>
 
 int main() {
 
-// Create object a
+// Create object a, keyed on integers so that 100 sorts after 99
 std::cout<<std::endl<<"> Creating new interval store A."<<std::endl;
-TwoDITwTopK a;
+TwoDITwTopKT<uint64_t> a;
 
 srand(time(NULL));
-std::string id, min, max;
+TwoDITId id;
+uint64_t min, max;
 int file_num=0, block_num=0, n1, n2, num_blocks=700+(rand()%600);
-uint64_t e=0;
+uint64_t e=0, total=0;
+std::vector<uint64_t> latency;
+latency.reserve(1000000);
 //std::chrono::time_point start_, end_;
 std::ofstream o1("insert.perf"), o2("deleteAll.perf"), o3("topK.perf");
 
@@ -23,11 +28,11 @@ std::ofstream o1("insert.perf"), o2("deleteAll.perf"), o3("topK.perf");
 std::cout<<std::endl<<"> Inserting 1,000,000 intervals (id, minKey, maxKey, maxTimestamp) into A:"<<std::endl;
 for (int i = 0; i < 1000000; i++) {
   
-  id = std::to_string(file_num) + '+' + std::to_string(block_num);
+  id = TwoDITId(file_num, block_num);
   n1 = rand() % 100000;
   n2 = rand() % 1000;
-  min = std::to_string(n1);
-  max = std::to_string((n2 < 100000) ? n2 : 99999);
+  min = n1;
+  max = (n1 + n2 < 100000) ? n1 + n2 : 99999;
   
   block_num++;
   if (block_num == num_blocks) {
@@ -39,8 +44,10 @@ for (int i = 0; i < 1000000; i++) {
     auto start_ = std::chrono::system_clock::now();
     a.insertInterval(id, min, max, i);
     auto end_ = std::chrono::system_clock::now();
-    auto elapsed = end_ - start_;
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end_ - start_);
     e += elapsed.count();
+    total += elapsed.count();
+    latency.push_back(elapsed.count());
   if (i % 1000 == 0) {
     std::cout<<i<<std::endl;
     o1<<i<<'\t'<<e<<std::endl;
@@ -49,10 +56,10 @@ for (int i = 0; i < 1000000; i++) {
   
 
   if (rand() % 10000 < 1) {
-    id = std::to_string(rand()%(file_num+1));
-    //std::cout<<"\nDeleting all intervals starting with: "<<id<<"";
+    uint64_t file = rand()%(file_num+1);
+    //std::cout<<"\nDeleting all intervals of file: "<<file<<"";
     auto start_2 = std::chrono::system_clock::now();
-    a.deleteAllIntervals(id);
+    a.deleteAllIntervals(file);
     auto end_2 = std::chrono::system_clock::now();
     auto elapsed = end_2 - start_2;
     o2<<i<<'\t'<<elapsed.count()<<std::endl;
@@ -62,15 +69,15 @@ for (int i = 0; i < 1000000; i++) {
   if (rand() % 1000 < 1) {
   n1 = rand() % 100000;
   n2 = rand() % 100;
-  min = std::to_string(n1);
-  max = std::to_string((n2 < 100000) ? n2 : 99999);
+  min = n1;
+  max = (n1 + n2 < 100000) ? n1 + n2 : 99999;
     //std::cout<<"\nDeleting all intervals starting with: "<<id<<"";
     auto start_3 = std::chrono::system_clock::now();
     
-    std::vector<TwoDInterval> r;
+    std::vector<TwoDIntervalT<uint64_t> > r;
 a.topK(r, min, max);
 //std::cout<<"\nRan topK successfully.\n";
-for(std::vector<TwoDInterval>::const_iterator it = r.begin(); it != r.end(); it++) {
+for(std::vector<TwoDIntervalT<uint64_t> >::const_iterator it = r.begin(); it != r.end(); it++) {
   it->GetId();
   it->GetLowPoint();
   it->GetHighPoint();
@@ -78,8 +85,8 @@ for(std::vector<TwoDInterval>::const_iterator it = r.begin(); it != r.end(); it+
 }
     
     /*int index = 0;
-    TwoDInterval r;
-    TopKIterator it(a, r, min, max);
+    TwoDIntervalT<uint64_t> r;
+    TopKIteratorT<uint64_t> it(a, r, min, max);
 
 while(it.next()) {
   r.GetId();
@@ -100,6 +107,12 @@ while(it.next()) {
 o1.close();
 o2.close();
 o3.close();
+
+// summary of the insert path, the per-1000 totals are in insert.perf
+std::sort(latency.begin(), latency.end());
+std::cout<<std::endl<<"> Insert latency over "<<latency.size()<<" inserts (ns):"<<std::endl;
+std::cout<<"  mean "<<total/latency.size()<<", p50 "<<latency[latency.size()/2]<<", p99 "<<latency[latency.size()*99/100]
+         <<", p99.9 "<<latency[latency.size()*999/1000]<<", max "<<latency.back()<<std::endl;
 }
 
 
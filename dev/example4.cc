@@ -0,0 +1,231 @@
+
+#include "TwoDITwTopK.h"
+#include <chrono>
+#include <cstdio>
+#include <csignal>
+#include <iostream>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Durability and read path checks: each prints what it finds and the program exits non-zero
+// if one fails.
+
+
+// ids with and without a block survive a sync and reload unchanged
+static bool checkSyncedIds() {
+
+std::cout<<std::endl<<"> Syncing a store with \"file\" and \"file+block\" ids, then reloading it:"<<std::endl;
+std::remove("example4.ids.str");
+
+std::vector<TwoDITId> ids;
+ids.push_back(TwoDITId(0, 2));
+ids.push_back(TwoDITId(1));
+ids.push_back(TwoDITId(3, 2));
+ids.push_back(TwoDITId(8));
+ids.push_back(TwoDITId(2));
+ids.push_back(TwoDITId(2, 7));
+
+{
+  TwoDITwTopKT<uint64_t> a;
+  a.setSyncFile("example4.ids.str");
+
+  for (size_t i = 0; i < ids.size(); i++) {
+    a.insertInterval(ids[i], 10 * i, 10 * i + 5, i + 1);
+  }
+
+  a.sync();
+}
+
+bool ok = true;
+
+// the reloaded store syncs as it closes, so it goes before the file does
+{
+  TwoDITwTopKT<uint64_t> b("example4.ids.str", true);
+
+  for (size_t i = 0; i < ids.size(); i++) {
+    TwoDIntervalT<uint64_t> r;
+    b.getInterval(r, ids[i]);
+    std::cout<<ids[i]<<" -> "<<(r.GetId().empty() ? std::string("missing") : r.GetId().str())<<std::endl;
+
+    if (r.GetId() != ids[i] or r.GetLowPoint() != 10 * i)
+      ok = false;
+  }
+
+  uint64_t size;
+  b.getSize(size);
+
+  if (size != ids.size())
+    ok = false;
+}
+
+std::remove("example4.ids.str");
+return ok;
+}
+
+
+// a process that dies without closing its store loses no logged write, whatever the fsync policy
+static bool checkLogCrash(const TwoDITFsyncPolicy &policy, const uint32_t &n, const std::string &name) {
+
+std::remove("example4.log.str");
+std::remove("example4.log.str.log");
+
+pid_t child = fork();
+
+if (child == 0) {
+  TwoDITwTopKT<uint64_t> a("example4.log.str", false);
+  a.setLogMode(true);
+  a.setFsyncPolicy(policy, n);
+
+  for (uint64_t i = 0; i < 50; i++) {
+    a.insertInterval(TwoDITId(i, 0), i, i + 10, i + 1);
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  _exit(0);
+}
+
+int status;
+waitpid(child, &status, 0);
+
+uint64_t size;
+
+{
+  TwoDITwTopKT<uint64_t> b("example4.log.str", true);
+  b.getSize(size);
+  std::cout<<name<<": "<<size<<" of 50 inserts recovered"<<std::endl;
+}
+
+std::remove("example4.log.str");
+std::remove("example4.log.str.log");
+return size == 50;
+}
+
+
+// a write whose log record cannot be written is refused, and leaves nothing in the log that
+// would stop the records after it from replaying
+static bool checkLogWriteFailure() {
+
+std::cout<<std::endl<<"> Failing a log write, then killing the process and reloading its store:"<<std::endl;
+std::remove("example4.fail.str");
+std::remove("example4.fail.str.log");
+
+pid_t child = fork();
+
+if (child == 0) {
+  TwoDITwTopKT<uint64_t> a("example4.fail.str", false);
+  a.setLogMode(true);
+
+  for (uint64_t i = 0; i < 10; i++) {
+    a.insertInterval(TwoDITId(i), i, i + 10, i + 1);
+  }
+
+  // the file size limit lets only part of the next record through
+  struct stat st;
+  struct rlimit limit;
+  stat("example4.fail.str.log", &st);
+  getrlimit(RLIMIT_FSIZE, &limit);
+  rlim_t soft = limit.rlim_cur;
+  limit.rlim_cur = st.st_size + 4;
+  signal(SIGXFSZ, SIG_IGN);
+  setrlimit(RLIMIT_FSIZE, &limit);
+
+  a.insertInterval(TwoDITId(10), 10, 20, 11);
+
+  limit.rlim_cur = soft;
+  setrlimit(RLIMIT_FSIZE, &limit);
+
+  TwoDIntervalT<uint64_t> r;
+  a.getInterval(r, TwoDITId(10));
+
+  for (uint64_t i = 11; i < 20; i++) {
+    a.insertInterval(TwoDITId(i), i, i + 10, i + 1);
+  }
+
+  _exit(r.GetId().empty() ? 0 : 1);
+}
+
+int status;
+waitpid(child, &status, 0);
+
+uint64_t size;
+TwoDIntervalT<uint64_t> failed, last;
+
+{
+  TwoDITwTopKT<uint64_t> b("example4.fail.str", true);
+  b.getSize(size);
+  b.getInterval(failed, TwoDITId(10));
+  b.getInterval(last, TwoDITId(19));
+}
+
+bool visible = !WIFEXITED(status) or WEXITSTATUS(status) != 0;
+std::cout<<"failed write "<<(visible ? "was" : "was not")<<" seen, "<<size<<" of 19 logged inserts recovered"<<std::endl;
+
+std::remove("example4.fail.str");
+std::remove("example4.fail.str.log");
+return !visible and size == 19 and failed.GetId().empty() and !last.GetId().empty();
+}
+
+
+// microseconds per topK on a fresh store of n intervals
+static double queryMicros(const uint64_t &n) {
+
+TwoDITwTopKT<uint64_t> a;
+a.setSyncFile("");
+
+for (uint64_t i = 0; i < n; i++) {
+  a.insertInterval(TwoDITId(i), 10 * i, 10 * i + 5, i + 1);
+}
+
+const uint32_t queries = 200000;
+std::vector<TwoDIntervalT<uint64_t> > result;
+std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+for (uint32_t q = 0; q < queries; q++) {
+  result.clear();
+  a.topK(result, 10 * (q % n), 10 * (q % n) + 50, 3);
+}
+
+return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / queries;
+}
+
+
+// a thread that has read many stores since destroyed queries a new one as fast as before
+static bool checkReadsAfterStores(const uint32_t &stores) {
+
+std::cout<<std::endl<<"> Querying a store before and after reading "<<stores<<" short-lived stores:"<<std::endl;
+double before = queryMicros(1000);
+
+for (uint32_t s = 0; s < stores; s++) {
+  TwoDITwTopKT<uint64_t> a;
+  a.setSyncFile("");
+  a.insertInterval(TwoDITId(s), 0, 10, 1);
+
+  std::vector<TwoDIntervalT<uint64_t> > result;
+  a.topK(result, 0, 10, 1);
+}
+
+double after = queryMicros(1000);
+std::cout<<"topK: "<<before<<" us before, "<<after<<" us after"<<std::endl;
+return after < 3 * before + 0.1;
+}
+
+
+int main() {
+
+bool ok = checkSyncedIds();
+
+std::cout<<std::endl<<"> Killing a process mid-log under each fsync policy, then reloading its store:"<<std::endl;
+ok = checkLogCrash(FSYNC_PER_OP, 1, "FSYNC_PER_OP") and ok;
+ok = checkLogCrash(FSYNC_PER_N_OPS, 1000, "FSYNC_PER_N_OPS") and ok;
+ok = checkLogCrash(FSYNC_PER_INTERVAL, 1000, "FSYNC_PER_INTERVAL") and ok;
+ok = checkLogCrash(FSYNC_NONE, 0, "FSYNC_NONE") and ok;
+ok = checkLogWriteFailure() and ok;
+ok = checkReadsAfterStores(50000) and ok;
+
+std::cout<<std::endl<<(ok ? "> All checks passed." : "> A check failed.")<<std::endl;
+return ok ? 0 : 1;
+}